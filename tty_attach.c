@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <asm/termbits.h>  // termios2 for any baud rate: not with <termios.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -8,9 +9,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <syslog.h>
@@ -18,6 +22,7 @@
 #include <unistd.h>
 
 #include "configure.h"
+#include "ttybus.h"
 
 #define MAX_TTY        256
 #define BUFFER_SIZE    4096
@@ -27,15 +32,62 @@
 static char *tty_bus_path;
 static char *devname;
 static char *init_string;
+static int use_ring = 0;
+static int old_bus = 0;  // -O: no hello, for a tty_bus that predates them
+static struct ttybus_ring ring;
+static struct ttybus_splice up, down;
+static int bus_pkt = 0;  // packet bus (tty_bus -P)
+static char pkt_buffer[TTYBUS_PKT_MAX * TTYBUS_PKT_BATCH];
+
+/* Framing (-F): what the device sends is held until the line has been silent
+ * for frame_gap usecs, and then goes to the bus as a single write. */
+static int framing = 0;
+static long frame_gap = 0;
+static char frame[BUFFER_SIZE];
+static int frame_len = 0;
+static int frame_timer = -1;
+static int frame_gap_auto = 0;  // derived from the baud rate, not given with -g
+
+/* Line settings (-r, -b, -V, -T, -H, -L), applied through termios2. Anything
+ * not asked for is left as it is. */
+static int line_raw = 0;
+static long line_baud = 0;  // any rate the driver can do, not just the Bxxx ones
+static int line_vmin = -1;
+static int line_vtime = -1;
+static int line_crtscts = 0;
+static int line_low_latency = 0;
+
+/* Control channel of the bus, where tty_fake sends the line settings its
+ * application asks for (see ttybus.h); -N leaves them alone. */
+static int line_follow = 1;
+static int ctlfd = -1;
+static int ctl_pkt = 0;
 
 
 static void usage(char *app) {
   fprintf(stderr, "%s, Ver %s.%s.%s\n", basename(app), MAJORV, MINORV, SVNVERSION);
-  fprintf(stderr, "Usage: %s [-h] [-s bus_path] tty_device\n", app);
+  fprintf(stderr, "Usage: %s [-h] [-s bus_path] [-r] [-b baud] [-V vmin] [-T vtime] [-H] [-L] [-N] [-F [-g usecs]] tty_device\n",
+          app);
   fprintf(stderr, "-h: shows this help\n");
   fprintf(stderr, "-d: detach from terminal and run as daemon\n");
   fprintf(stderr, "-s bus_path: uses bus_path as bus path name (default: /tmp/ttybus)\n");
-  fprintf(stderr, "-i init_string: send init string to device\n\n");
+  fprintf(stderr, "-i init_string: send init string to device\n");
+  fprintf(stderr, "-O: for a tty_bus older than hellos, which would pass them on as data: don't say it is the\n");
+  fprintf(stderr, "   device endpoint, and open no control channel (implies -N, not with -m)\n");
+  fprintf(stderr, "-m: read bus data from the bus shared-memory ring (tty_bus -m) instead of the socket\n");
+  fprintf(stderr, "-r: raw mode: no echo, line editing, signals or character translation, 8 bits no parity\n");
+  fprintf(stderr, "-b baud: line speed, any rate the driver supports, not only the standard ones\n");
+  fprintf(stderr, "-V vmin: minimum number of characters for a read to return, in raw mode\n");
+  fprintf(stderr, "-T vtime: read timeout in tenths of a second, in raw mode\n");
+  fprintf(stderr, "-H: hardware (RTS/CTS) flow control\n");
+  fprintf(stderr, "-L: ask the driver for low latency (ASYNC_LOW_LATENCY): USB serial adapters then hand over\n");
+  fprintf(stderr, "   what they read right away, instead of every 16ms\n");
+  fprintf(stderr, "-N: don't apply the line settings applications set on tty_fake devices of the bus (speed, stop\n");
+  fprintf(stderr, "   bits, flow control) to the device\n");
+  fprintf(stderr, "-F: frame mode, as for Modbus RTU: send what the device says to the bus one frame per write, a frame\n");
+  fprintf(stderr, "   ending when the line stays silent for 3.5 character times at the device baud rate; sets the\n");
+  fprintf(stderr, "   line to raw mode\n");
+  fprintf(stderr, "-g usecs: with -F, silence that ends a frame, instead of the one derived from the baud rate\n\n");
   fprintf(stderr, "Please also see: tty_bus, tty_fake, tty_plug, dpipe\n");
   fprintf(stderr, "Example of usage:\n");
   fprintf(stderr, "  Create a new bus called /tmp/ttyS0mux\n");
@@ -45,17 +97,197 @@ static void usage(char *app) {
   fprintf(stderr, "  Create two fake ttyS0 devices, attached to the bus /tmp/ttyS0mux\n");
   fprintf(stderr, "    tty_fake -d -s /tmp/ttyS0mux /dev/ttyS0.0\n");
   fprintf(stderr, "    tty_fake -d -s /tmp/ttyS0mux /dev/ttyS0.1\n");
+  fprintf(stderr, "  Share a Modbus RTU line, each bus write being a whole frame\n");
+  fprintf(stderr, "    tty_attach -d -s /tmp/modbus -F /dev/ttyUSB0\n");
+  fprintf(stderr, "  Connect a device at 250000 baud with hardware flow control, in raw mode, with low latency\n");
+  fprintf(stderr, "    tty_attach -d -s /tmp/ttyUSB0mux -r -b 250000 -H -L /dev/ttyUSB0\n");
   exit(2);
 }
 
 
+/* Apply the line settings asked for, and log what the line ends up with.
+ * Framing needs raw mode too. */
+static int line_setup(int dev) {
+  struct termios2 t;
+  struct serial_struct ser;
+  const char *low_latency = "n/a";
+
+  if (ioctl(dev, TCGETS2, &t) < 0)
+    return -1;
+  if (line_raw || framing) {
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(CSIZE | PARENB);
+    t.c_cflag |= CS8;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+  }
+  if (line_vmin >= 0)
+    t.c_cc[VMIN] = line_vmin;
+  if (line_vtime >= 0)
+    t.c_cc[VTIME] = line_vtime;
+  if (line_baud > 0) {
+    t.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    t.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    t.c_ispeed = t.c_ospeed = line_baud;
+  }
+  if (line_crtscts)
+    t.c_cflag |= CRTSCTS;
+  // read back what the driver made of it: it may round the baud rate
+  if (ioctl(dev, TCSETS2, &t) < 0 || ioctl(dev, TCGETS2, &t) < 0)
+    return -1;
+  line_baud = t.c_ospeed;
+
+  if (ioctl(dev, TIOCGSERIAL, &ser) == 0) {
+    if (line_low_latency && !(ser.flags & ASYNC_LOW_LATENCY)) {
+      ser.flags |= ASYNC_LOW_LATENCY;
+      if (ioctl(dev, TIOCSSERIAL, &ser) < 0 || ioctl(dev, TIOCGSERIAL, &ser) < 0) {
+        fprintf(stderr, "Cannot set low latency on %s: %s\n", devname, strerror(errno));
+        syslog(LOG_WARNING, "Cannot set low latency on %s: %s\n", devname, strerror(errno));
+      }
+    }
+    low_latency = ser.flags & ASYNC_LOW_LATENCY ? "on" : "off";
+  } else if (line_low_latency) {
+    fprintf(stderr, "No low latency setting on %s: %s\n", devname, strerror(errno));
+    syslog(LOG_WARNING, "No low latency setting on %s: %s\n", devname, strerror(errno));
+  }
+
+  fprintf(stderr, "Line %s: %u baud, %s mode, vmin %d vtime %d, %s flow control, low latency %s\n", devname,
+          t.c_ospeed, t.c_lflag & ICANON ? "canonical" : "raw", t.c_cc[VMIN], t.c_cc[VTIME],
+          t.c_cflag & CRTSCTS ? "rts/cts" : "no", low_latency);
+  syslog(LOG_INFO, "Line %s: %u baud, %s mode, vmin %d vtime %d, %s flow control, low latency %s\n", devname,
+         t.c_ospeed, t.c_lflag & ICANON ? "canonical" : "raw", t.c_cc[VMIN], t.c_cc[VTIME],
+         t.c_cflag & CRTSCTS ? "rts/cts" : "no", low_latency);
+  return 0;
+}
+
+
+/* Work out the silence ending a frame, once the line is set up: 3.5
+ * characters of 11 bits, or 1750us above 19200 baud, as Modbus RTU has it. */
+static int frame_setup(void) {
+  long baud = line_baud;
+
+  if (frame_gap == 0)
+    frame_gap_auto = 1;
+  if (frame_gap_auto)
+    frame_gap = baud > 19200 || baud == 0 ? 1750 : 3500L * 11 * 1000 / baud;
+  if (frame_timer >= 0)
+    close(frame_timer);
+  frame_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (frame_timer < 0)
+    return -1;
+  fprintf(stderr, "Framing %s at %ld baud: frames end after %ldus of silence\n", devname, baud, frame_gap);
+  syslog(LOG_INFO, "Framing %s at %ld baud: frames end after %ldus of silence\n", devname, baud, frame_gap);
+  return 0;
+}
+
+
+/* Apply a line settings line from the control channel */
+static void line_apply(int dev, char *line) {
+  struct termios2 t;
+  char flow[8];
+  unsigned int speed;
+  int stop;
+
+  if (sscanf(line, TTYBUS_CTL_TERMIOS " speed=%u stop=%d flow=%7s", &speed, &stop, flow) != 3 || speed == 0 ||
+      ioctl(dev, TCGETS2, &t) < 0)
+    return;
+  t.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT) | CSTOPB | CRTSCTS);
+  t.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  if (stop == 2)
+    t.c_cflag |= CSTOPB;
+  if (strcmp(flow, "rtscts") == 0)
+    t.c_cflag |= CRTSCTS;
+  t.c_ispeed = t.c_ospeed = speed;
+  if (ioctl(dev, TCSETS2, &t) < 0 || ioctl(dev, TCGETS2, &t) < 0) {
+    fprintf(stderr, "Cannot apply %s to %s: %s\n", line, devname, strerror(errno));
+    syslog(LOG_WARNING, "Cannot apply %s to %s: %s\n", line, devname, strerror(errno));
+    return;
+  }
+  line_baud = t.c_ospeed;
+  fprintf(stderr, "Line %s set from the bus: %s\n", devname, line + strlen(TTYBUS_CTL_TERMIOS " "));
+  syslog(LOG_INFO, "Line %s set from the bus: %s\n", devname, line + strlen(TTYBUS_CTL_TERMIOS " "));
+  if (framing && frame_gap_auto)
+    frame_setup();
+}
+
+
+/* Read the control channel, applying each complete line. Returns -1 once
+ * the bus is gone. */
+static int ctl_read(int dev) {
+  static char buf[TTYBUS_PKT_MAX];
+  static int len = 0;
+  char *line, *nl;
+  int r;
+
+  if (ctl_pkt)
+    r = ttybus_pkt_recv(ctlfd, buf + len, sizeof(buf) - len - 1);
+  else
+    r = read(ctlfd, buf + len, sizeof(buf) - len - 1);
+  if (r < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  if (r == 0)
+    return -1;
+  len += r;
+  for (line = buf; (nl = memchr(line, '\n', buf + len - line)) != NULL; line = nl + 1) {
+    *nl = '\0';
+    line_apply(dev, line);
+  }
+  len -= line - buf;
+  memmove(buf, line, len);
+  if (len == sizeof(buf) - 1)
+    len = 0;  // not a line of ours
+  return 0;
+}
+
+
+/* Send the frame read so far to the bus, in one write */
+static void frame_flush(int fd) {
+  struct itimerspec off;
+  int w, done = 0;
+
+  memset(&off, 0, sizeof(off));
+  timerfd_settime(frame_timer, 0, &off, NULL);
+  while (done < frame_len) {
+    w = write(fd, frame + done, frame_len - done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0) {
+      fprintf(stderr, "Bus write error: %s\n", strerror(errno));
+      syslog(LOG_ERR, "Bus write error: %s\n", strerror(errno));
+      exit(1);
+    }
+    done += w;
+  }
+  frame_len = 0;
+}
+
+
+/* Take what the device has to say into the frame, and restart the silence
+ * timer; a full frame buffer ends the frame too. */
+static void frame_read(int dev, int fd) {
+  struct itimerspec when;
+  int r;
+
+  r = read(dev, frame + frame_len, sizeof(frame) - frame_len);
+  if (r <= 0)
+    return;
+  frame_len += r;
+  if (frame_len == sizeof(frame)) {
+    frame_flush(fd);
+    return;
+  }
+  memset(&when, 0, sizeof(when));
+  when.it_value.tv_sec = frame_gap / 1000000;
+  when.it_value.tv_nsec = (frame_gap % 1000000) * 1000;
+  timerfd_settime(frame_timer, 0, &when, NULL);
+}
+
+
 int tty_connect(char *path) {
-  struct sockaddr_un sun;
-  int connect_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-  memset(&sun, 0, sizeof(struct sockaddr_un));
-  sun.sun_family = AF_UNIX;
-  strncpy(sun.sun_path, path, strlen(path));
-  if (connect(connect_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+  int connect_fd = ttybus_connect(path, &bus_pkt);
+  if (connect_fd < 0) {
     perror("Cannot connect to socket");
     syslog(LOG_ERR, "Cannot connect to socket");
     exit(-1);
@@ -66,7 +298,7 @@ int tty_connect(char *path) {
 
 int main(int argc, char *argv[]) {
   int fd;
-  struct pollfd pfd[2];
+  struct pollfd pfd[5];
   int pollret, r;
   char buffer[BUFFER_SIZE];
   int realdev;
@@ -74,17 +306,58 @@ int main(int argc, char *argv[]) {
 
   while (1) {
     int c;
-    c = getopt(argc, argv, "dhi:s:");
+    c = getopt(argc, argv, "b:dFg:hHi:LmNOrs:T:V:");
     if (c == -1)
       break;
 
     switch (c) {
+      case 'b':
+        line_baud = atol(optarg);
+        if (line_baud < 1)
+          usage(argv[0]);  // implies exit
+        break;
       case 'd':
         daemonize = 1;
         break;
+      case 'F':
+        framing = 1;
+        break;
+      case 'g':
+        frame_gap = atol(optarg);
+        if (frame_gap < 1)
+          usage(argv[0]);  // implies exit
+        break;
       case 'h':
         usage(argv[0]);  // implies exit
         break;
+      case 'H':
+        line_crtscts = 1;
+        break;
+      case 'L':
+        line_low_latency = 1;
+        break;
+      case 'm':
+        use_ring = 1;
+        break;
+      case 'N':
+        line_follow = 0;
+        break;
+      case 'O':
+        old_bus = 1;
+        line_follow = 0;
+        break;
+      case 'r':
+        line_raw = 1;
+        break;
+      case 'T':
+      case 'V':
+        if (atoi(optarg) < 0 || atoi(optarg) > 255)
+          usage(argv[0]);  // implies exit
+        if (c == 'T')
+          line_vtime = atoi(optarg);
+        else
+          line_vmin = atoi(optarg);
+        break;
       case 's':
         tty_bus_path = strdup(optarg);
         break;
@@ -95,7 +368,7 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);  // implies exit
     }
   }
-  if (optind != (argc - 1))
+  if (optind != (argc - 1) || (old_bus && use_ring))
     usage(argv[0]);  // implies exit
 
   if (daemonize)
@@ -109,12 +382,44 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "Connecting to bus: %s\n", tty_bus_path);
   syslog(LOG_INFO, "Connecting to bus: %s\n", tty_bus_path);
   fd = tty_connect(tty_bus_path);
+  // what star clients send on the bus is for the device endpoints only
+  if (use_ring && ttybus_ring_attach(fd, "role=device", &ring) < 0) {
+    fprintf(stderr, "No shared ring on bus %s, reading from the socket\n", tty_bus_path);
+    syslog(LOG_WARNING, "No shared ring on bus %s, reading from the socket\n", tty_bus_path);
+    use_ring = 0;
+  } else if (!use_ring && !old_bus && ttybus_hello(fd, "role=device", -1, NULL, 0, NULL) < 0) {
+    fprintf(stderr, "Cannot send hello to bus %s\n", tty_bus_path);
+    syslog(LOG_WARNING, "Cannot send hello to bus %s\n", tty_bus_path);
+  }
+
+  if (line_follow) {
+    ctlfd = ttybus_connect(tty_bus_path, &ctl_pkt);
+    if (ctlfd < 0 || ttybus_hello(ctlfd, "ctl role=device", -1, NULL, 0, NULL) < 0) {
+      fprintf(stderr, "No control channel on bus %s: line settings from fake ttys are ignored\n", tty_bus_path);
+      syslog(LOG_WARNING, "No control channel on bus %s: line settings from fake ttys are ignored\n", tty_bus_path);
+      if (ctlfd >= 0)
+        close(ctlfd);
+      ctlfd = -1;
+    }
+  }
 
   realdev = open(devname, O_RDWR);
   if (realdev < 0) {
     perror("opening device");
     exit(3);
   }
+  // a line nobody asked to configure may well not be a tty at all
+  if (line_setup(realdev) < 0 &&
+      (line_raw || line_baud || line_vmin >= 0 || line_vtime >= 0 || line_crtscts || line_low_latency || framing)) {
+    fprintf(stderr, "Cannot set up line %s: %s\n", devname, strerror(errno));
+    syslog(LOG_ERR, "Cannot set up line %s: %s\n", devname, strerror(errno));
+    exit(3);
+  }
+  if (framing && frame_setup() < 0) {
+    fprintf(stderr, "Cannot set up framing on %s: %s\n", devname, strerror(errno));
+    syslog(LOG_ERR, "Cannot set up framing on %s: %s\n", devname, strerror(errno));
+    exit(3);
+  }
 
   if (init_string) {
     pfd[0].fd = realdev;
@@ -133,12 +438,33 @@ int main(int argc, char *argv[]) {
       syslog(LOG_WARNING, "Device is busy, cannot send init string.\n");
     }
   }
+  ttybus_splice_init(&up);
+  ttybus_splice_init(&down);
+  if (bus_pkt) {
+    // one message per read, and several messages per recvmmsg() the other way
+    up.fallback = 1;
+    down.pkt = 1;
+  }
   for (;;) {
     pfd[0].fd = realdev;
     pfd[0].events = POLLIN;
     pfd[1].fd = fd;
     pfd[1].events = POLLIN;
-    pollret = poll(pfd, 2, 1000);
+    pfd[2].fd = -1;
+    pfd[3].fd = frame_timer;
+    pfd[3].events = POLLIN;
+    pfd[4].fd = ctlfd;
+    pfd[4].events = POLLIN;
+    if (use_ring) {
+      while ((r = ttybus_ring_read(&ring, buffer, BUFFER_SIZE)) > 0)
+        write(realdev, buffer, r);
+      if (ttybus_ring_arm(&ring))
+        continue;
+      pfd[2].fd = ring.efd;
+      pfd[2].events = POLLIN;
+    }
+    // unused entries have a negative fd, and are skipped
+    pollret = poll(pfd, 5, 1000);
     if (pollret < 0) {
       fprintf(stderr, "Poll error: %s\n", strerror(errno));
       syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
@@ -150,8 +476,20 @@ int main(int argc, char *argv[]) {
     if ((pfd[0].revents & POLLHUP || pfd[0].revents & POLLERR || pfd[0].revents & POLLNVAL) ||
         (pfd[1].revents & POLLHUP || pfd[1].revents & POLLERR || pfd[1].revents & POLLNVAL))
       exit(1);
-    if (pfd[0].revents & POLLIN) {
-      r = read(realdev, buffer, BUFFER_SIZE);
+    if (use_ring && (pfd[2].revents & POLLIN))
+      ttybus_ring_ack(&ring);
+    if ((pfd[4].revents & (POLLIN | POLLHUP | POLLERR)) && ctl_read(realdev) < 0) {
+      close(ctlfd);
+      ctlfd = -1;
+    }
+    if (framing && (pfd[3].revents & POLLIN)) {
+      uint64_t expired;
+      if (read(frame_timer, &expired, sizeof(expired)) > 0 && frame_len > 0)
+        frame_flush(fd);
+    }
+    if (framing && (pfd[0].revents & POLLIN)) {
+      frame_read(realdev, fd);
+    } else if (pfd[0].revents & POLLIN) {
       pfd[1].events = POLLOUT;
       pollret = poll(&pfd[1], 1, 50);
       if (pollret < 0) {
@@ -160,10 +498,9 @@ int main(int argc, char *argv[]) {
         exit(1);
       }
       if (pfd[1].revents & POLLOUT)
-        write(fd, buffer, r);
+        ttybus_splice(&up, realdev, fd, buffer, BUFFER_SIZE);
     }
     if (pfd[1].revents & POLLIN) {
-      r = read(fd, buffer, BUFFER_SIZE);
       pfd[0].fd = realdev;
       pfd[0].events = POLLOUT;
       pollret = poll(&pfd[0], 1, 50);
@@ -173,7 +510,7 @@ int main(int argc, char *argv[]) {
        exit(1);
       }
       if (pfd[0].revents & POLLOUT)
-        write(realdev, buffer, r);
+        ttybus_splice(&down, fd, realdev, pkt_buffer, sizeof(pkt_buffer));
     }
   }
 }
\ No newline at end of file
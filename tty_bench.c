@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "configure.h"
+#include "ttybus.h"
+
+#define BUFFER_SIZE  4096
+#define MAX_RUNS     32
+#define MAX_ARGS     32
+#define MAX_SAMPLES  (1 << 22)
+#define BENCH_MAGIC  0x4d425454  // "TTBM"
+#define IDLE_TIMEOUT 1000        // ms without data after the producers are done
+#define SETUP_WAIT   2000        // ms to wait for the bus and fake ttys to show up
+#define BRIDGE_WAIT  5000        // ms to wait for the bridge to carry data across
+
+/* Every message starts with this header, and is padded to msg_size */
+struct bench_msg {
+  uint32_t magic;
+  uint32_t producer;
+  uint64_t seq;
+  uint64_t sent;  // CLOCK_MONOTONIC, ns
+};
+
+/* A synthetic client: a unix socket connected to the bus, or the slave side of
+ * a tty_fake started for it. */
+struct endpoint {
+  int fd;
+  pid_t fake;  // tty_fake process, pty transport only
+  char link[64];
+  char *buf;
+  int len;
+  unsigned long received;
+  uint64_t *next_seq;      // per producer, the seq expected next
+  unsigned long reordered;  // messages older than one already received
+  unsigned long gaps;       // seqs skipped over: dropped, or coming late
+};
+
+static char *bus_path = "/tmp/ttybus.bench";
+static char far_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];  // consumers' bus, with -L
+static char *bridge_cmd;
+static char *bus_bin = "./tty_bus";
+static char *fake_bin = "./tty_fake";
+static char *bus_args[MAX_ARGS];
+static int nbus_args = 0;
+static int use_pty = 0;
+static int bus_pkt = 0;  // the bus runs with -P
+static int nproducers = 1;
+static int msg_size = 64;
+static long messages = 10000;
+static long rate = 0;  // messages per second per producer, 0: as fast as possible
+
+static struct endpoint *eps;  // consumers first, then producers
+static int nconsumers;
+static pthread_t producer_thread;
+static volatile int producers_done;
+static uint64_t *samples;
+static long nsamples;
+
+
+static void usage(char *app) {
+  fprintf(stderr, "%s, Ver %s.%s.%s\n", basename(app), MAJORV, MINORV, SVNVERSION);
+  fprintf(stderr, "Usage: %s [-h] [-s bus_path] [-B tty_bus] [-F tty_fake] [-a bus_option]... [-c counts] [-p producers]\n",
+          app);
+  fprintf(stderr, "          [-n messages] [-l size] [-r rate] [-P] [-L bridge_command]\n");
+  fprintf(stderr, "-h: shows this help\n");
+  fprintf(stderr, "-s bus_path: path of the bus started for each run (default: /tmp/ttybus.bench)\n");
+  fprintf(stderr, "-B tty_bus: tty_bus binary to benchmark (default: ./tty_bus)\n");
+  fprintf(stderr, "-F tty_fake: tty_fake binary used with -P (default: ./tty_fake)\n");
+  fprintf(stderr, "-a bus_option: pass this argument on to tty_bus; may be repeated, e.g. -a -t -a 2\n");
+  fprintf(stderr, "-c counts: comma separated numbers of consumers, one run each (default: 1,16,256)\n");
+  fprintf(stderr, "-p producers: number of producers (default: 1)\n");
+  fprintf(stderr, "-n messages: messages sent by each producer (default: 10000)\n");
+  fprintf(stderr, "-l size: message size in bytes, at least %d (default: 64)\n", (int) sizeof(struct bench_msg));
+  fprintf(stderr, "-r rate: messages per second sent by each producer (default: as fast as possible)\n");
+  fprintf(stderr, "-P: connect clients through tty_fake ptys instead of unix sockets\n");
+  fprintf(stderr, "-L bridge_command: start a second bus, bus_path.far, for the consumers, and run this\n");
+  fprintf(stderr, "   /bin/sh command to link the two, %%n and %%f standing for the producers' and the\n");
+  fprintf(stderr, "   consumers' bus, e.g. \"./dpipe ./tty_plug -s %%n = ./tty_plug -s %%f\"\n\n");
+  fprintf(stderr, "Prints one JSON object per run on stdout:\n");
+  fprintf(stderr, "  msgs_per_sec, bytes_per_sec: delivered to consumers, from the first send to the last receive\n");
+  fprintf(stderr, "  p50_us, p99_us, p999_us: one-way latency, producer write to consumer read\n");
+  fprintf(stderr, "  drop_rate: share of the messages consumers should have received and didn't\n");
+  fprintf(stderr, "  reordered: messages a consumer got after a later one of the same producer; the run fails if any\n");
+  fprintf(stderr, "  gaps: messages a consumer missed between two it got from the same producer\n");
+  fprintf(stderr, "  cpu_ns_per_byte: CPU time of tty_bus (and the tty_fake processes, the bridge) per byte delivered\n");
+  exit(2);
+}
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static pid_t spawn(char *bin, char **args, int nargs, char *last1, char *last2, char *last3) {
+  char *argv[MAX_ARGS + 8];
+  int i, n = 0;
+  pid_t pid;
+
+  argv[n++] = bin;
+  for (i = 0; i < nargs; i++)
+    argv[n++] = args[i];
+  argv[n++] = last1;
+  argv[n++] = last2;
+  argv[n++] = last3;
+  argv[n] = NULL;
+  pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    execv(bin, argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+
+/* Run the bridge command in a process group of its own, so that all it starts
+ * can be accounted for and stopped together */
+static pid_t bridge_spawn(void) {
+  char cmd[1024];
+  char *c, *d = cmd;
+  pid_t pid;
+
+  for (c = bridge_cmd; *c && d < cmd + sizeof(cmd) - sizeof(far_path); c++) {
+    if (c[0] == '%' && (c[1] == 'n' || c[1] == 'f')) {
+      d += sprintf(d, "%s", *++c == 'n' ? bus_path : far_path);
+      continue;
+    }
+    *d++ = *c;
+  }
+  *d = '\0';
+  pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    setpgid(0, 0);
+    dup2(null, STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+    _exit(127);
+  }
+  if (pid > 0)
+    setpgid(pid, pid);
+  return pid;
+}
+
+
+/* CPU time used so far by the processes of a group, in ns. The bridge is
+ * stopped with its children still running, so wait4() can't tell. */
+static double group_cpu(pid_t pgid) {
+  char path[300], stat[1024], *p;
+  unsigned long utime, stime;
+  double ns = 0;
+  struct dirent *de;
+  DIR *dir;
+  int fd, r, pgrp;
+
+  dir = opendir("/proc");
+  if (!dir)
+    return 0;
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] < '0' || de->d_name[0] > '9')
+      continue;
+    snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+      continue;
+    r = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (r <= 0)
+      continue;
+    stat[r] = '\0';
+    // the command name may contain anything, fields restart after its ')'
+    p = strrchr(stat, ')');
+    if (p && sscanf(p + 2, "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &pgrp, &utime, &stime) == 3 &&
+        pgrp == pgid)
+      ns += (utime + stime) * 1e9 / sysconf(_SC_CLK_TCK);
+  }
+  closedir(dir);
+  return ns;
+}
+
+
+/* Send probes from the producers' bus until one makes it to the consumers'
+ * bus, and throw them all away */
+static int bridge_wait(struct endpoint *from, struct endpoint *to) {
+  struct pollfd pfd;
+  int waited, up = 0;
+
+  for (waited = 0; waited < BRIDGE_WAIT && !up; waited += 100) {
+    write(from->fd, "probe\n", 6);
+    pfd.fd = to->fd;
+    pfd.events = POLLIN;
+    up = poll(&pfd, 1, 100) > 0;
+  }
+  usleep(200000);
+  for (; to <= from; to++)
+    while (read(to->fd, to->buf, BUFFER_SIZE) > 0)
+      ;
+  return up ? 0 : -1;
+}
+
+
+static int bus_connect(const char *path) {
+  int fd = ttybus_connect(path, &bus_pkt);
+  if (fd >= 0)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+
+static int endpoint_open(struct endpoint *e, int n, char *path) {
+  struct termios t;
+  int waited;
+
+  e->fake = -1;
+  e->len = 0;
+  e->received = 0;
+  e->reordered = 0;
+  e->gaps = 0;
+  e->next_seq = calloc(nproducers, sizeof(uint64_t));
+  // room for a whole recvmmsg() batch on packet buses
+  e->buf = malloc(TTYBUS_PKT_MAX * TTYBUS_PKT_BATCH + msg_size);
+  if (!e->buf || !e->next_seq)
+    return -1;
+  if (!use_pty) {
+    e->fd = bus_connect(path);
+    return e->fd;
+  }
+  snprintf(e->link, sizeof(e->link), "/tmp/ttybench.%d.%d", getpid(), n);
+  unlink(e->link);
+  e->fake = spawn(fake_bin, NULL, 0, "-s", path, e->link);
+  for (waited = 0; waited < SETUP_WAIT; waited += 10) {
+    e->fd = open(e->link, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (e->fd >= 0)
+      break;
+    usleep(10000);
+  }
+  if (e->fd < 0)
+    return -1;
+  tcgetattr(e->fd, &t);
+  cfmakeraw(&t);
+  tcsetattr(e->fd, TCSANOW, &t);
+  return e->fd;
+}
+
+
+static void endpoint_close(struct endpoint *e, struct rusage *cpu) {
+  struct rusage ru;
+
+  close(e->fd);
+  free(e->buf);
+  free(e->next_seq);
+  if (e->fake > 0) {
+    kill(e->fake, SIGTERM);
+    if (wait4(e->fake, NULL, 0, &ru) > 0) {
+      timeradd(&cpu->ru_utime, &ru.ru_utime, &cpu->ru_utime);
+      timeradd(&cpu->ru_stime, &ru.ru_stime, &cpu->ru_stime);
+    }
+  }
+}
+
+
+static int write_all(int fd, char *buf, int len) {
+  struct pollfd pfd;
+  int w;
+  while (len > 0) {
+    w = write(fd, buf, len);
+    if (w < 0 && errno == EAGAIN) {
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return -1;
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+
+/* Each producer sends its messages in turn, at the requested rate */
+static void *producer_main(void *arg) {
+  char *msg = calloc(1, msg_size);
+  struct bench_msg *m = (struct bench_msg *) msg;
+  uint64_t start = now_ns(), next;
+  long seq;
+  int p;
+
+  (void) arg;
+  m->magic = BENCH_MAGIC;
+  for (seq = 0; seq < messages; seq++) {
+    if (rate > 0) {
+      next = start + seq * 1000000000ULL / rate;
+      while (now_ns() < next)
+        usleep(50);
+    }
+    for (p = 0; p < nproducers; p++) {
+      m->producer = p;
+      m->seq = seq;
+      m->sent = now_ns();
+      write_all(eps[nconsumers + p].fd, msg, msg_size);
+    }
+  }
+  free(msg);
+  producers_done = 1;
+  return NULL;
+}
+
+
+/* Split what a consumer got into messages. The bus may drop chunks, so a
+ * stream that doesn't start with a header is resynchronized on the next one.
+ * Drops only leave gaps in the seqs of a producer: they must never go back. */
+static void consume(struct endpoint *e, uint64_t now) {
+  struct bench_msg m;
+  uint32_t magic = BENCH_MAGIC;
+  char *next;
+  int off = 0;
+
+  while (e->len - off >= msg_size) {
+    memcpy(&m, e->buf + off, sizeof(m));
+    if (m.magic != BENCH_MAGIC || m.producer >= (uint32_t) nproducers) {
+      next = memmem(e->buf + off + 1, e->len - off - 1, &magic, sizeof(magic));
+      off = next ? next - e->buf : e->len - (int) sizeof(magic) + 1;
+      continue;
+    }
+    e->received++;
+    if (m.seq < e->next_seq[m.producer]) {
+      e->reordered++;
+    } else {
+      e->gaps += m.seq - e->next_seq[m.producer];
+      e->next_seq[m.producer] = m.seq + 1;
+    }
+    if (nsamples < MAX_SAMPLES)
+      samples[nsamples++] = now - m.sent;
+    off += msg_size;
+  }
+  memmove(e->buf, e->buf + off, e->len - off);
+  e->len -= off;
+}
+
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+
+static double percentile(double p) {
+  long i;
+  if (nsamples == 0)
+    return 0;
+  i = (long) (p * nsamples);
+  if (i >= nsamples)
+    i = nsamples - 1;
+  return samples[i] / 1000.0;
+}
+
+
+static int run(int consumers) {
+  struct epoll_event ev, events[64];
+  struct rusage cpu, ru;
+  uint64_t first, last = 0, idle_since = 0, t;
+  unsigned long received = 0, expected, delivered, reordered = 0, gaps = 0;
+  double secs, cpu_ns, bridge_ns = 0;
+  pid_t bus, far = -1, bridge = -1;
+  int i, n, r, total, waited, efd, bridged = 1;
+
+  nconsumers = consumers;
+  total = consumers + nproducers;
+  unlink(bus_path);
+  bus = spawn(bus_bin, bus_args, nbus_args, "-s", bus_path, NULL);
+  if (bridge_cmd) {
+    unlink(far_path);
+    far = spawn(bus_bin, bus_args, nbus_args, "-s", far_path, NULL);
+  }
+  for (waited = 0; waited < SETUP_WAIT; waited += 10) {
+    if ((i = bus_connect(bus_path)) >= 0 && (!bridge_cmd || (close(i), i = bus_connect(far_path)) >= 0))
+      break;
+    usleep(10000);
+  }
+  if (i < 0) {
+    fprintf(stderr, "Cannot start %s\n", bus_bin);
+    return -1;
+  }
+  close(i);
+  if (bridge_cmd)
+    bridge = bridge_spawn();
+
+  memset(&cpu, 0, sizeof(cpu));
+  eps = calloc(total, sizeof(struct endpoint));
+  efd = epoll_create1(EPOLL_CLOEXEC);
+  for (i = 0; i < total; i++) {
+    if (endpoint_open(&eps[i], i, bridge_cmd && i < consumers ? far_path : bus_path) < 0) {
+      fprintf(stderr, "Cannot connect client %d: %s\n", i, strerror(errno));
+      total = i;
+      goto out;
+    }
+    fcntl(eps[i].fd, F_SETFL, fcntl(eps[i].fd, F_GETFL) | O_NONBLOCK);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(efd, EPOLL_CTL_ADD, eps[i].fd, &ev);
+  }
+  usleep(200000);
+  if (bridge_cmd && bridge_wait(&eps[consumers], &eps[0]) < 0) {
+    fprintf(stderr, "The bridge doesn't carry data: %s\n", bridge_cmd);
+    bridged = 0;
+    goto out;
+  }
+
+  nsamples = 0;
+  producers_done = 0;
+  first = now_ns();
+  pthread_create(&producer_thread, NULL, producer_main, NULL);
+  expected = (unsigned long) consumers * nproducers * messages;
+  for (;;) {
+    n = epoll_wait(efd, events, 64, 100);
+    t = now_ns();
+    for (i = 0; i < n; i++) {
+      struct endpoint *e = &eps[events[i].data.u32];
+      while ((r = bus_pkt && !use_pty ? ttybus_pkt_recv(e->fd, e->buf + e->len, TTYBUS_PKT_MAX * TTYBUS_PKT_BATCH)
+                                      : read(e->fd, e->buf + e->len, BUFFER_SIZE)) > 0) {
+        if (events[i].data.u32 >= (uint32_t) consumers)
+          continue;  // producers get each other's messages too
+        e->len += r;
+        consume(e, now_ns());
+      }
+    }
+    received = 0;
+    for (i = 0; i < consumers; i++)
+      received += eps[i].received;
+    if (n > 0) {
+      last = t;
+      idle_since = t;
+    }
+    if (received >= expected)
+      break;
+    if (producers_done && idle_since && t - idle_since > IDLE_TIMEOUT * 1000000ULL)
+      break;
+    if (producers_done && !idle_since)
+      idle_since = t;
+  }
+  pthread_join(producer_thread, NULL);
+  for (i = 0; i < consumers; i++) {
+    reordered += eps[i].reordered;
+    gaps += eps[i].gaps;
+  }
+
+out:
+  if (bridge > 0) {
+    bridge_ns = group_cpu(bridge);
+    kill(-bridge, SIGTERM);
+    waitpid(bridge, NULL, 0);
+  }
+  for (i = 0; i < total; i++)
+    endpoint_close(&eps[i], &cpu);
+  close(efd);
+  free(eps);
+  kill(bus, SIGTERM);
+  if (wait4(bus, NULL, 0, &ru) > 0) {
+    timeradd(&cpu.ru_utime, &ru.ru_utime, &cpu.ru_utime);
+    timeradd(&cpu.ru_stime, &ru.ru_stime, &cpu.ru_stime);
+  }
+  if (far > 0) {
+    kill(far, SIGTERM);
+    if (wait4(far, NULL, 0, &ru) > 0) {
+      timeradd(&cpu.ru_utime, &ru.ru_utime, &cpu.ru_utime);
+      timeradd(&cpu.ru_stime, &ru.ru_stime, &cpu.ru_stime);
+    }
+  }
+  if (total < consumers + nproducers || !bridged)
+    return -1;
+
+  qsort(samples, nsamples, sizeof(uint64_t), cmp_u64);
+  secs = last > first ? (last - first) / 1e9 : 1e-9;
+  delivered = received * msg_size;
+  cpu_ns = (cpu.ru_utime.tv_sec + cpu.ru_stime.tv_sec) * 1e9 + (cpu.ru_utime.tv_usec + cpu.ru_stime.tv_usec) * 1e3 +
+           bridge_ns;
+  printf("{\"transport\":\"%s%s\",\"consumers\":%d,\"producers\":%d,\"msg_size\":%d,\"messages\":%lu,\"received\":%lu,"
+         "\"seconds\":%.6f,\"msgs_per_sec\":%.1f,\"bytes_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+         "\"p999_us\":%.1f,\"drop_rate\":%.6f,\"reordered\":%lu,\"gaps\":%lu,\"cpu_ns_per_byte\":%.3f}\n",
+         use_pty ? "pty" : bus_pkt ? "seqpacket" : "unix", bridge_cmd ? "+bridge" : "", consumers, nproducers, msg_size, expected, received, secs, received / secs,
+         delivered / secs, percentile(0.50), percentile(0.99), percentile(0.999),
+         expected ? 1.0 - (double) received / expected : 0.0, reordered, gaps, delivered ? cpu_ns / delivered : 0.0);
+  fflush(stdout);
+  if (reordered > 0) {
+    fprintf(stderr, "%lu messages out of order with %d consumers\n", reordered, consumers);
+    return -1;
+  }
+  return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+  char *counts = "1,16,256";
+  char *tok, *save = NULL;
+  int runs[MAX_RUNS];
+  int nruns = 0;
+  int i, status = 0;
+  struct rlimit nofile;
+
+  while (1) {
+    int c;
+    c = getopt(argc, argv, "a:B:c:F:hl:L:n:p:Pr:s:");
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'a':
+        if (nbus_args == MAX_ARGS)
+          usage(argv[0]);  // implies exit
+        bus_args[nbus_args++] = optarg;
+        break;
+      case 'B':
+        bus_bin = optarg;
+        break;
+      case 'c':
+        counts = optarg;
+        break;
+      case 'F':
+        fake_bin = optarg;
+        break;
+      case 'h':
+        usage(argv[0]);  // implies exit
+        break;
+      case 'l':
+        msg_size = atoi(optarg);
+        break;
+      case 'L':
+        bridge_cmd = optarg;
+        break;
+      case 'n':
+        messages = atol(optarg);
+        break;
+      case 'p':
+        nproducers = atoi(optarg);
+        break;
+      case 'P':
+        use_pty = 1;
+        break;
+      case 'r':
+        rate = atol(optarg);
+        break;
+      case 's':
+        bus_path = optarg;
+        break;
+      default:
+        usage(argv[0]);  // implies exit
+    }
+  }
+  if (optind < argc || msg_size < (int) sizeof(struct bench_msg) || msg_size > BUFFER_SIZE || nproducers < 1 ||
+      messages < 1)
+    usage(argv[0]);  // implies exit
+  snprintf(far_path, sizeof(far_path), "%s.far", bus_path);
+  counts = strdup(counts);
+  for (tok = strtok_r(counts, ",", &save); tok && nruns < MAX_RUNS; tok = strtok_r(NULL, ",", &save)) {
+    runs[nruns] = atoi(tok);
+    if (runs[nruns] < 1)
+      usage(argv[0]);  // implies exit
+    nruns++;
+  }
+
+  // two fds per pty client, and the same for the bus
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  samples = malloc(sizeof(uint64_t) * MAX_SAMPLES);
+  if (!samples)
+    exit(1);
+  for (i = 0; i < nruns; i++) {
+    if (run(runs[i]) < 0)
+      status = 1;
+  }
+  unlink(bus_path);
+  if (bridge_cmd)
+    unlink(far_path);
+  return status;
+}
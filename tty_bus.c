@@ -1,39 +1,418 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <asm/termbits.h>  // termios2, as tty_fake: not with <termios.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "configure.h"
+#include "ttybus.h"
 
-#define MAX_TTY        256
+#define MAX_CLIENTS    4096
+#define TTY_INIT       64
 #define BUFFER_SIZE    4096
 #define POLL_R_TIMEOUT 100
-#define POLL_W_TIMEOUT 50
-static char *tty_bus_path = NULL;
+#define MAX_EVENTS     64
+/* epoll tags: a client slot, or one of the flags below, which never overlap */
+#define EVENT_SLOT     0x20000000U  // timerfds, eventfds and other single fds
+#define TIMER_SLOT     (EVENT_SLOT | 1)
+#define WAKE_SLOT      (EVENT_SLOT | 2)
+#define DIR_SLOT       (EVENT_SLOT | 3)
+#define CTL_SLOT       (EVENT_SLOT | 4)
+#define TXN_SLOT       (EVENT_SLOT | 5)
+#define CTL_CONN       0x40000000U  // control connection n: CTL_CONN | n
+#define BUS_SLOT       0x80000000U  // listening socket of bus n: BUS_SLOT | n
+#define READ_BUDGET    4
+#define QUEUE_LEN      64
+#define QUEUE_MAX      65536
+#define FLUSH_IOV      64
+#define RING_MIN       65536
+#define WORKER_QUEUE   4096
+#define MAX_BUSES      256
+#define MAX_CTL        8
+#define LAT_BUCKETS    20
+#define CAP_SIZE       (16 << 20)
+#define CAP_FILES      4
+#define MAX_FILTERS    16
+#define KICK_AFTER     1000  // ms
+#define REPLY_TIMEOUT  1000  // ms
+#define REPLY_GAP      20000  // usecs
+#define TXN_QUEUE      64
+#define TXN_TAIL       64
+#define DEFAULT_BUS    "/tmp/ttybus"
+static int epfd = -1;
+static int read_budget = READ_BUDGET;
+static unsigned int queue_len = QUEUE_LEN;
+static volatile sig_atomic_t stats_requested = 0;
+static uint32_t next_client_id = 1;
+static int max_clients = MAX_CLIENTS;
+
+/* Write coalescing (-w/-W): chunks are only queued, and all queues are flushed
+ * together once batch_window usecs have passed since the first pending chunk,
+ * or batch_threshold bytes are pending. Consecutive reads from the same talker
+ * are appended to one open chunk while nobody has consumed it yet. */
+static long batch_window = 0;
+static int batch_threshold = BUFFER_SIZE;
+static int batch_timerfd = -1;
+static int batch_armed = 0;
+static int batch_bytes = 0;
+static struct chunk *batch_chunk = NULL;
+
+/* Transaction buses (--transact): how long the device may stay silent before
+ * its reply starts and once it has, and the timer set to the earliest end of
+ * a transaction in progress. */
+static long reply_timeout = REPLY_TIMEOUT;  // ms
+static long reply_gap = REPLY_GAP;          // usecs
+static char *default_transact = NULL;       // terminators, "" for silence only, NULL for none
+static int txn_timerfd = -1;
+static uint64_t txn_armed = 0;
+
+struct bus_counters {
+  unsigned long wakeups;
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long chunks;
+  unsigned long bytes;
+  unsigned long drops;
+  unsigned long ring_wakes;
+  unsigned long rejects;
+  unsigned long flushes;
+};
+
+// per thread, summed up by print_stats()
+static __thread struct bus_counters counters;
+
+/* Per client counters. The in side is only written by the main thread, the out
+ * side by the thread writing to the client. latency[i] counts the chunks
+ * written out less than 2^i us after they were read, the last bucket the rest. */
+struct client_stats {
+  unsigned long chunks_in;
+  unsigned long bytes_in;
+  unsigned long chunks_out;
+  unsigned long bytes_out;
+  unsigned long drops;      // not queued: the client wasn't taking data fast enough
+  unsigned long drops_old;  // dropped from the queue for newer ones (drop-oldest)
+  unsigned long stalls;     // its full queue stopped the bus (block)
+  unsigned long kicks;      // disconnected for staying behind (disconnect)
+  unsigned long latency[LAT_BUCKETS];
+};
+
+/* What happens to a chunk for a client whose output queue is full */
+enum {
+  POLICY_DROP_NEWEST,  // the chunk is not queued
+  POLICY_DROP_OLDEST,  // the oldest chunk not being written makes room for it
+  POLICY_BLOCK,        // never full: the bus stops reading while it is
+  POLICY_DISCONNECT,   // dropped, and the client goes once above high water for kick_after ms
+  POLICY_COUNT
+};
+
+/* Who a client talks and listens to, from the "role=" hello option */
+enum {
+  ROLE_BOTH,    // everyone, the default
+  ROLE_LISTEN,  // gets the bus traffic, what it sends is dropped
+  ROLE_TALK,    // sends to everyone, gets nothing
+  ROLE_STAR,    // sends to the device endpoints only, gets what everyone sends
+  ROLE_DEVICE,  // an endpoint the star clients talk to: --attach, tty_attach
+  ROLE_COUNT
+};
+
+static const char *role_names[ROLE_COUNT] = {"both", "listen", "talk", "star", "device"};
+
+static const char *policy_names[POLICY_COUNT] = {"drop-newest", "drop-oldest", "block", "disconnect"};
+static int default_policy = POLICY_DROP_NEWEST;
+static long kick_after = KICK_AFTER;
+
+/* Shared-memory broadcast ring of a bus (-m), see ttybus.h */
+struct bus_ring {
+  int memfd;
+  size_t maplen;
+  struct ttybus_ring_hdr *hdr;
+  char *data;
+  int efd[TTYBUS_RING_CONSUMERS];  // wakeup eventfd of each consumer, -1 if free
+};
+
+/* Capture of the traffic of a bus to memory-mapped files (--capture), see
+ * ttybus.h. Recording a chunk is a copy into the mapping; the only syscalls
+ * are the ones rotating to a new file when the current one is full. */
+struct capture {
+  char *path;
+  int fd;
+  char *map;
+  struct ttybus_cap_hdr *hdr;
+  uint32_t seq;
+};
+
+static size_t cap_size = CAP_SIZE;
+static int cap_files = CAP_FILES;
+
+/* All buses are served by the same event loop and client table; each one
+ * only fans out to its own members. Buses come from -s, or from the *.bus
+ * definition files in bus_dir (-D), which is watched to add and remove buses
+ * at runtime. Entries are reused, never freed, so a bus index held in a queued
+ * chunk stays valid. */
+struct bus {
+  char *path;     // NULL if the entry is unused
+  char *defname;  // definition file in bus_dir, NULL for buses given with -s
+  int listenfd;
+  int pending;  // the listening socket is readable
+  int *members;
+  int nmembers;
+  int members_size;
+  unsigned long chunks;
+  unsigned long bytes;
+  uint32_t seq;      // reads numbered so far, for the packet headers (-P)
+  uint32_t cur_seq;  // number of the read being handled, for all its chunks
+  int nfiltered;  // members with a line filter
+  int policy;     // for its clients, unless they ask for another one
+  int nblocking;  // members with the block policy
+  int stalled;    // those of them with a full queue
+  int transact;   // requests go to the devices one at a time (--transact)
+  struct line_filter *terms;  // ends of a reply, besides silence, or NULL
+  int owner;                  // client whose request is in progress, or -1
+  uint32_t owner_id;          // (the slot may be reused after it left)
+  int replied;                // the reply has started
+  uint64_t deadline;          // when silence ends the transaction
+  char tail[TXN_TAIL];        // end of the reply so far, for a terminator cut between reads
+  int tail_len;
+  struct chunk *txq[TXN_QUEUE];  // requests waiting for their turn
+  int txq_head;
+  int txq_count;
+  unsigned long transactions;
+  unsigned long noreply;  // ended by the timeout, without a reply
+  struct client_stats gone;  // totals of the clients that left
+  struct bus_ring ring;
+  struct capture *cap;  // or NULL
+};
+
+static struct bus buses[MAX_BUSES];
+static int nbuses = 0;  // one past the highest entry ever used
+static size_t ring_size = 0;
+static int bus_type = SOCK_STREAM;  // SOCK_SEQPACKET with -P
+static char *bus_dir = NULL;
+static int dir_watch = -1;
+
+/* Control socket (-C): each connection sends one request line, "text" or
+ * "json", and gets the bus and client counters back in that format. */
+struct ctl_conn {
+  int fd;  // -1 if unused
+  char *out;
+  size_t len;
+  size_t off;
+};
+
+static char *ctl_path = NULL;
+static int ctl_fd = -1;
+static struct ctl_conn ctl[MAX_CTL];
+
+/* Devices (--attach) and fake ttys (--fake) served by tty_bus itself, as bus
+ * members without a tty_attach or tty_fake process and socket in between.
+ * Each one joins the bus of the last -s before it, or the first bus. */
+#define MAX_ENDPOINTS  64
+enum { ENDPOINT_ATTACH, ENDPOINT_FAKE };
+
+struct endpoint {
+  int type;
+  char *path;
+  int bus;    // index in the -s list
+  int slave;  // fake: the slave side, held open
+  char *bak;  // fake: where -o moved an existing file to
+  char line_sent[TTYBUS_CTL_MAX];  // fake: line settings last sent on the control channel
+};
+
+/* --capture paths, with the index in the -s list of the bus they record */
+static char *captures[MAX_BUSES];
+static int capture_bus[MAX_BUSES];
+static int ncaptures = 0;
+
+static struct endpoint endpoints[MAX_ENDPOINTS];
+static int nendpoints = 0;
+static int fake_cooked = 0;  // --cooked: leave --fake ptys in their default mode instead of raw
+static int force_overwrite = 0;
+
+/* A chunk read from one client, shared by the output queues of all the others */
+struct chunk {
+  int refs;
+  int len;
+  int cap;
+  int src;
+  int bus;
+  int dest;        // the only client it is for, or -1 for every member of the bus
+  int to_devices;  // from a star client: for the device endpoints only
+  int ctl;         // on the control channel
+  uint32_t src_id;  // id of the client it came from
+  uint32_t seq;     // number in the bus, for the packet headers (-P)
+  uint64_t stamp;   // when it was read, CLOCK_MONOTONIC ns
+  char data[];
+};
+
+
+/* Lines a client subscribed to with the "prefix=" and "match=" hello options:
+ * those starting with one of the prefixes or containing one of the patterns. */
+struct line_filter {
+  int n;
+  char *pat[MAX_FILTERS];
+  int len[MAX_FILTERS];
+  int anywhere[MAX_FILTERS];  // a "match=" pattern rather than a prefix
+};
+
+
+/* Bounded ring of pending chunks; 'off' is how much of the head chunk is already written */
+struct outq {
+  struct chunk **ring;
+  unsigned int head;
+  unsigned int count;
+  int off;
+};
+
+struct tty_client {
+  int fd;
+  uint32_t id;
+  int bus;
+  int bus_member;  // index in the bus member list
+  int closing;     // handed back to its worker to be closed (-t)
+  int worker;      // worker that writes to it (-t)
+  int member;      // index in the worker's member list (-t)
+  int dead;        // a write failed, waiting for the reader to notice (-t)
+  int blocked;     // last flush hit EAGAIN, wait for EPOLLOUT
+  int fresh;       // nothing read yet, the stream may start with a hello
+  int pkt;         // SOCK_SEQPACKET connection to a packet bus (-P)
+  int policy;      // when its output queue is full
+  int role;
+  int ctl;         // on the control channel of the bus ("ctl" hello option)
+  int stalled;     // has input the bus won't read until a blocking queue drains
+  uint64_t high_since;  // queue above high water since then (disconnect policy)
+  int ring_slot;   // reads the shared ring instead of the socket, or -1
+  int ready;       // queued on the ready list
+  int next_ready;
+  int next_free;
+  pid_t pid;         // peer process of a socket client, 0 if unknown
+  const char *name;  // device or fake tty path of an endpoint, or NULL
+  struct endpoint *fake;  // --fake endpoint whose pty master this is, read in packet mode
+  struct line_filter *filter;  // only gets the lines matching it, or NULL
+  char *line;                  // start of a line sent without its end yet
+  int line_len;                // (kept while the bus has filtered members)
+  struct client_stats stats;
+  struct outq q;
+};
+
+/* Client table: grows by doubling up to max_clients. Unused slots are kept on
+ * a free list, and clients with pending input on a FIFO ready list, serviced
+ * round-robin read_budget chunks at a time. */
+static struct tty_client *tty = NULL;
+static int tty_size = 0;
+static int tty_top = 0;  // one past the highest slot ever used
+static int nclients = 0;
+static int free_head = -1;
+static int ready_head = -1, ready_tail = -1, ready_count = 0;
+
+/* Sharded fan-out (-t): the main thread accepts, reads and creates chunks, and
+ * each client is written by one of nworkers threads with its own event loop.
+ * The main thread passes chunks, and client arrivals and departures, to every
+ * worker through a single-producer single-consumer ring, so each client sees
+ * chunks in the order they were read. The client table is allocated at its
+ * full size upfront, so workers can index it while the main thread runs. */
+enum { SHARD_CHUNK, SHARD_ADD, SHARD_DEL };
+
+struct shard_msg {
+  int type;
+  int slot;
+  struct chunk *ch;
+};
+
+struct worker {
+  pthread_t thread;
+  int epfd;
+  int efd;
+  struct shard_msg *q;
+  unsigned int head;  // next message to process, written by the worker
+  unsigned int tail;  // next free entry, written by the main thread
+  int sleeping;       // set by the worker before waiting on efd
+  int *members;       // slots it writes to
+  int nmembers;
+  int load;  // clients assigned, main thread only
+  struct bus_counters *counters;
+};
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+static pthread_mutex_t release_lock = PTHREAD_MUTEX_INITIALIZER;
+static int release_head = -1;  // slots closed by workers, not yet back on the free list
 
 
 static void usage(char *app) {
   fprintf(stderr, "%s, Ver %s.%s.%s\n", basename(app), MAJORV, MINORV, SVNVERSION);
-  fprintf(stderr, "Usage: %s [-h] [-s bus_path]\n", app);
+  fprintf(stderr, "Usage: %s [-h] [-s bus_path]... [-D bus_dir] [-P] [--attach device]... [--fake tty_device]... [-o]\n", app);
   fprintf(stderr, "-h: shows this help\n");
   fprintf(stderr, "-d: detach from terminal and run as daemon\n");
-  fprintf(stderr, "-s bus_path: uses bus_path as bus path name (default: /tmp/ttybus)\n\n");
+  fprintf(stderr, "-s bus_path: uses bus_path as bus path name (default: %s); may be repeated to serve several buses\n",
+          DEFAULT_BUS);
+  fprintf(stderr, "-D bus_dir: also serve a bus for each bus_dir/name.bus file, adding and removing them as the files\n");
+  fprintf(stderr, "   come and go; the bus path is bus_dir/name, unless the file has a path=bus_path line\n");
+  fprintf(stderr, "--attach device: connect a real tty device to the bus, like tty_attach, but from tty_bus itself\n");
+  fprintf(stderr, "--fake tty_device: create a fake tty device on the bus, like tty_fake, but from tty_bus itself\n");
+  fprintf(stderr, "   both join the bus of the last -s option before them; may be repeated\n");
+  fprintf(stderr, "--cooked: leave the --fake ttys in the default (line editing, echo) mode of a pty, instead of raw\n");
+  fprintf(stderr, "-o: with --fake, temporarly backup tty_device to tty_device.bak, if it exists, and restore the original\n");
+  fprintf(stderr, "   file at exit\n");
+  fprintf(stderr, "-b budget: reads per client per pass when several clients are talking (default: %d)\n", READ_BUDGET);
+  fprintf(stderr, "-q length: chunks queued per client before dropping, up to %d (default: %d)\n", QUEUE_MAX,
+          QUEUE_LEN);
+  fprintf(stderr, "--policy policy: what to do when a client queue is full, for the bus of the last -s before it, or\n");
+  fprintf(stderr, "   for all buses if given before any -s: drop-newest (default), drop-oldest, block (stop reading\n");
+  fprintf(stderr, "   from the bus clients until the queue drains, lossless; not with -t) or disconnect (drop newest,\n");
+  fprintf(stderr, "   and disconnect the client once its queue stays 3/4 full for --kick-after ms); clients may ask\n");
+  fprintf(stderr, "   for their own with the policy= hello option\n");
+  fprintf(stderr, "--kick-after ms: see --policy (default: %d)\n", KICK_AFTER);
+  fprintf(stderr, "--transact[=terminators]: for half-duplex command/response devices, on the bus of the last -s\n");
+  fprintf(stderr, "   before it, or on all buses if given before any -s: what clients send goes to the device\n");
+  fprintf(stderr, "   endpoints (--attach, tty_attach) one request at a time, and the reply only to the client that\n");
+  fprintf(stderr, "   asked; it ends with one of the comma separated terminators (%%XX stands for the byte of hex\n");
+  fprintf(stderr, "   value XX, e.g. --transact=OK%%0D%%0A,ERROR%%0D%%0A) or when the device stays silent\n");
+  fprintf(stderr, "--reply-timeout ms: with --transact, how long to wait for a reply to start (default: %d)\n",
+          REPLY_TIMEOUT);
+  fprintf(stderr, "--reply-gap usecs: with --transact, silence that ends a reply (default: %d)\n", REPLY_GAP);
+  fprintf(stderr, "-c max_clients: refuse connections beyond this number of clients (default: %d)\n", MAX_CLIENTS);
+  fprintf(stderr, "-w usecs: coalesce writes to clients, flushing at most usecs after the first pending chunk\n");
+  fprintf(stderr, "-W bytes: with -w, flush as soon as this many bytes are pending (default: %d)\n", BUFFER_SIZE);
+  fprintf(stderr, "-t threads: write to clients from this many worker threads (not with -w)\n");
+  fprintf(stderr, "-P: packet buses: clients connect with SOCK_SEQPACKET, each write is a message of at most %d\n",
+          TTYBUS_PKT_MAX);
+  fprintf(stderr, "   bytes, and each message comes with the id of its sender and a sequence number\n");
+  fprintf(stderr, "-m size: also publish bus data in a shared-memory ring of size bytes, for local clients using -m\n");
+  fprintf(stderr, "--capture path: record the traffic of the bus of the last -s before it to path, with timestamps\n");
+  fprintf(stderr, "   and senders; may be repeated\n");
+  fprintf(stderr, "--capture-size bytes: size of each capture file (default: %d)\n", CAP_SIZE);
+  fprintf(stderr, "--capture-files n: capture files kept, the current one and n - 1 older ones (default: %d)\n", CAP_FILES);
+  fprintf(stderr, "-C ctl_path: serve bus and client counters on the unix socket ctl_path; send \"text\" or \"json\"\n");
+  fprintf(stderr, "   on a connection to get them in that format\n");
+  fprintf(stderr, "Send SIGUSR1 to print throughput counters\n\n");
   fprintf(stderr, "Please also see: tty_attach, tty_fake, tty_plug, dpipe\n");
   fprintf(stderr, "Example of usage:\n");
   fprintf(stderr, "  Create a new bus called /tmp/ttyS0mux\n");
@@ -47,8 +426,42 @@ static void usage(char *app) {
 }
 
 
+/* Cut the file down to what was recorded, and unmap it */
+void capture_close(struct capture *cap) {
+  uint64_t end;
+
+  if (!cap->map)
+    return;
+  end = cap->hdr->end;
+  munmap(cap->map, cap_size);
+  ftruncate(cap->fd, end);
+  close(cap->fd);
+  cap->map = NULL;
+}
+
+
 void exiting(void) {
-  unlink(tty_bus_path);
+  int b, e;
+  for (b = 0; b < nbuses; b++) {
+    if (buses[b].path)
+      unlink(buses[b].path);
+    if (buses[b].cap)
+      capture_close(buses[b].cap);
+  }
+  if (ctl_path)
+    unlink(ctl_path);
+  for (e = 0; e < nendpoints; e++) {
+    if (endpoints[e].type != ENDPOINT_FAKE)
+      continue;
+    if (endpoints[e].slave >= 0)
+      unlink(endpoints[e].path);
+    if (endpoints[e].bak) {
+      fprintf(stderr, "Restoring original device %s\n", endpoints[e].path);
+      syslog(LOG_INFO, "Restoring original device %s\n", endpoints[e].path);
+      link(endpoints[e].bak, endpoints[e].path);
+      unlink(endpoints[e].bak);
+    }
+  }
 }
 
 
@@ -57,28 +470,70 @@ void signaled(int signo) {
 }
 
 
-int bus_init(char *path) {
+void stats_signaled(int signo) {
+  stats_requested = 1;
+}
+
+
+void print_stats(void) {
+  struct bus_counters t = counters;
+  unsigned long syscalls;
+  double per_syscall;
+  int i;
+
+  // worker counters are read while they run: good enough for monitoring
+  for (i = 0; i < nworkers; i++) {
+    struct bus_counters *w = workers[i].counters;
+    t.wakeups += w->wakeups;
+    t.writes += w->writes;
+    t.drops += w->drops;
+    t.flushes += w->flushes;
+  }
+  syscalls = t.wakeups + t.reads + t.writes;
+  per_syscall = syscalls ? (double) t.chunks / syscalls : 0.0;
+  fprintf(stderr, "clients %d/%d wakeups %lu reads %lu writes %lu chunks %lu bytes %lu drops %lu ring_wakes %lu rejects %lu "
+          "flushes %lu chunks/syscall %.3f\n", nclients, tty_size, t.wakeups, t.reads, t.writes, t.chunks, t.bytes,
+          t.drops, t.ring_wakes, t.rejects, t.flushes, per_syscall);
+  syslog(LOG_INFO, "clients %d/%d wakeups %lu reads %lu writes %lu chunks %lu bytes %lu drops %lu ring_wakes %lu rejects %lu "
+         "flushes %lu chunks/syscall %.3f\n", nclients, tty_size, t.wakeups, t.reads, t.writes, t.chunks, t.bytes,
+         t.drops, t.ring_wakes, t.rejects, t.flushes, per_syscall);
+  for (i = 0; i < nbuses; i++) {
+    if (!buses[i].path)
+      continue;
+    fprintf(stderr, "bus %s clients %d chunks %lu bytes %lu\n", buses[i].path, buses[i].nmembers, buses[i].chunks,
+            buses[i].bytes);
+    syslog(LOG_INFO, "bus %s clients %d chunks %lu bytes %lu\n", buses[i].path, buses[i].nmembers, buses[i].chunks,
+           buses[i].bytes);
+  }
+}
+
+
+/* Returns -1 on failure rather than exiting: buses can be added at runtime */
+int bus_init(char *path, int type) {
   struct sockaddr_un sun;
-  int connect_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  int connect_fd = socket(PF_UNIX, type, 0);
   memset(&sun, 0, sizeof(struct sockaddr_un));
   sun.sun_family = AF_UNIX;
-  strncpy(sun.sun_path, path, strlen(path));
+  strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
   if (bind(connect_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
     if ((errno == EADDRINUSE)) {
       printf("Could not bind to socket '%s': %s\n", path, strerror(errno));
       syslog(LOG_ERR, "Could not bind to socket '%s': %s\n", path, strerror(errno));
-      exit(-1);
+      close(connect_fd);
+      return -1;
     } else if (bind(connect_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
       printf("Could not bind to socket '%s' (second attempt): %s", path, strerror(errno));
       syslog(LOG_ERR, "Could not bind to socket '%s' (second attempt): %s", path, strerror(errno));
-      exit(-1);
+      close(connect_fd);
+      return -1;
     }
   }
   chmod(sun.sun_path, 0777);
-  if (listen(connect_fd, 1) < 0) {
+  if (listen(connect_fd, SOMAXCONN) < 0) {
     printf("Could not listen on fd %d: %s", connect_fd, strerror(errno));
     syslog(LOG_ERR, "Could not listen on fd %d: %s", connect_fd, strerror(errno));
-    exit(-1);
+    close(connect_fd);
+    return -1;
   }
   return connect_fd;
 }
@@ -90,182 +545,2368 @@ void bus_destroy(int fd, char *path) {
 }
 
 
-int prepare_poll(int *tty, struct pollfd **ppfd, int lfd, int flags) {
-  struct pollfd *pfd = (struct pollfd *) *ppfd;
-  int i, fdcount = 0;
-  if (lfd != -1)
-    pfd[fdcount++].fd = lfd;
+static int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 
-  for (i = 0; i < MAX_TTY; i++) {
-    if (tty[i] != -1)
-      pfd[fdcount++].fd = tty[i];
+/* The listening socket and every client are registered once in the epoll set,
+ * edge-triggered. Clients carry their slot index in epoll_data so a wakeup only
+ * touches the fds that are actually ready. */
+int event_add(int fd, uint32_t slot, uint32_t events) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events | EPOLLET;
+  ev.data.u32 = slot;
+  if (set_nonblock(fd) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(stderr, "Cannot add fd %d to event set: %s\n", fd, strerror(errno));
+    syslog(LOG_WARNING, "Cannot add fd %d to event set: %s\n", fd, strerror(errno));
+    return -1;
   }
+  return 0;
+}
+
+
+int ring_init(struct bus_ring *ring, size_t size) {
+  size_t data_off, len;
+  void *map;
+  int i;
+
+  for (len = RING_MIN; len < size; len <<= 1)
+    ;
+  data_off = (sizeof(struct ttybus_ring_hdr) + 4095) & ~4095UL;
+  ring->memfd = memfd_create("ttybus", MFD_CLOEXEC);
+  if (ring->memfd < 0 || ftruncate(ring->memfd, data_off + len) < 0)
+    return -1;
+  map = mmap(NULL, data_off + len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  ring->maplen = data_off + len;
+  ring->hdr = map;
+  ring->data = (char *) map + data_off;
+  ring->hdr->magic = TTYBUS_RING_MAGIC;
+  ring->hdr->size = len;
+  ring->hdr->data_off = data_off;
+  for (i = 0; i < TTYBUS_RING_CONSUMERS; i++)
+    ring->efd[i] = -1;
+  return 0;
+}
 
-  for (i = 0; i < fdcount; i++)
-    pfd[i].events = flags;
 
-  return fdcount;
+// consumers keep their own mapping, the memory goes away when they do
+void ring_destroy(struct bus_ring *ring) {
+  if (ring->memfd < 0)
+    return;
+  munmap(ring->hdr, ring->maplen);
+  close(ring->memfd);
+  ring->memfd = -1;
 }
 
 
-void init_dev_array(int **ptty) {
+/* Copy the chunk into the ring once, whatever the number of consumers, and
+ * kick only the consumers that went to sleep waiting for it. */
+void ring_publish(struct bus_ring *ring, uint32_t src, char *buf, int size) {
+  struct ttybus_ring_rec rec;
+  uint64_t head = ring->hdr->head;
+  uint32_t off = head & (ring->hdr->size - 1);
+  uint32_t reclen = (sizeof(rec) + size + TTYBUS_RING_ALIGN - 1) & ~(TTYBUS_RING_ALIGN - 1);
+  uint64_t one = 1;
   int i;
-  int *tty = *ptty;
-  for (i = 0; i < MAX_TTY; i++)
-    tty[i] = -1;
+
+  if (off + reclen > ring->hdr->size) {
+    rec.pos = head;
+    rec.len = TTYBUS_RING_PAD;
+    rec.src = 0;
+    memcpy(ring->data + off, &rec, sizeof(rec));
+    head += ring->hdr->size - off;
+    // publish the padding first, so readers never see the writer more than one record ahead of head
+    __atomic_store_n(&ring->hdr->head, head, __ATOMIC_RELEASE);
+    off = 0;
+  }
+  rec.pos = head;
+  rec.len = size;
+  rec.src = src;
+  memcpy(ring->data + off, &rec, sizeof(rec));
+  memcpy(ring->data + off + sizeof(rec), buf, size);
+  __atomic_store_n(&ring->hdr->head, head + reclen, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&ring->hdr->waiters, __ATOMIC_SEQ_CST) == 0)
+    return;
+  for (i = 0; i < TTYBUS_RING_CONSUMERS; i++) {
+    if (ring->efd[i] < 0 || !__atomic_exchange_n(&ring->hdr->consumer[i].armed, 0, __ATOMIC_SEQ_CST))
+      continue;
+    __atomic_fetch_sub(&ring->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    write(ring->efd[i], &one, sizeof(one));
+    counters.ring_wakes++;
+  }
 }
 
 
-int check_poll_errors(struct pollfd *pfd, int n, int *tty) {
-  int i, j;
-  int err = 0;
-  for (i = 0; i < n; i++) {
-    if (pfd[i].revents & POLLHUP || pfd[i].revents & POLLERR || pfd[i].revents & POLLNVAL) {
-      for (j = 0; j < MAX_TTY; j++) {
-        if (tty[j] == pfd[i].fd) {
-          close(tty[j]);
-          tty[j] = -1;
-          ++err;
-          break;
-        }
-      }
-    }
+void ring_release(struct bus_ring *ring, int slot) {
+  if (__atomic_exchange_n(&ring->hdr->consumer[slot].armed, 0, __ATOMIC_SEQ_CST))
+    __atomic_fetch_sub(&ring->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  close(ring->efd[slot]);
+  ring->efd[slot] = -1;
+}
+
+
+/* Hand the ring over to a client that asked for it in its hello, along with
+ * the id it has to skip its own records by. */
+int ring_subscribe(struct tty_client *c, int efd) {
+  struct bus_ring *ring = &buses[c->bus].ring;
+  char reply[TTYBUS_HELLO_MAX];
+  int i;
+
+  if (ring->memfd < 0 || efd < 0)
+    return -1;
+  for (i = 0; i < TTYBUS_RING_CONSUMERS; i++) {
+    if (ring->efd[i] == -1)
+      break;
+  }
+  if (i == TTYBUS_RING_CONSUMERS)
+    return -1;
+  snprintf(reply, sizeof(reply), "ring id=%u slot=%d", c->id, i);
+  // stop the fan-out to the socket first: the client ignores data until the reply
+  ring->hdr->consumer[i].armed = 0;
+  ring->hdr->consumer[i].id = c->id;
+  ring->efd[i] = efd;
+  if (ttybus_hello(c->fd, reply, ring->memfd, NULL, 0, NULL) < 0) {
+    ring->efd[i] = -1;
+    return -1;
+  }
+  __atomic_store_n(&c->ring_slot, i, __ATOMIC_RELAXED);  // read by workers
+  return 0;
+}
+
+
+/* Double the client table (up to max_clients) and put the new slots on the free list */
+int tty_grow(void) {
+  struct tty_client *t;
+  int i, size = tty_size ? tty_size * 2 : TTY_INIT;
+
+  if (nworkers > 0)
+    size = max_clients;  // never moves once workers use it
+  if (size > max_clients)
+    size = max_clients;
+  if (size <= tty_size)
+    return -1;
+  t = realloc(tty, sizeof(struct tty_client) * size);
+  if (!t) {
+    fprintf(stderr, "alloc error: %s\n", strerror(errno));
+    syslog(LOG_ERR, "alloc error: %s\n", strerror(errno));
+    return -1;
   }
-  return err;
+  memset(t + tty_size, 0, sizeof(struct tty_client) * (size - tty_size));
+  for (i = size - 1; i >= tty_size; i--) {
+    t[i].fd = -1;
+    t[i].next_free = free_head;
+    free_head = i;
+  }
+  tty = t;
+  tty_size = size;
+  return 0;
+}
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 
-void recvbuff(int src, char *buf, int size, int *tty) {
-  struct pollfd *wpfd;
-  int n, i;
-  int pollret;
+struct chunk *chunk_new(int src, char *buf, int size, int cap) {
+  struct chunk *ch;
 
-  wpfd = (struct pollfd *) malloc(sizeof(struct pollfd) * MAX_TTY);
-  if (!wpfd) {
+  if (cap < size)
+    cap = size;
+  ch = malloc(sizeof(struct chunk) + cap);
+  if (!ch) {
     fprintf(stderr, "alloc error: %s\n", strerror(errno));
     syslog(LOG_INFO, "alloc error: %s\n", strerror(errno));
+    return NULL;
   }
+  ch->refs = 1;  // atomic from here on, chunks are shared between threads with -t
+  ch->len = size;
+  ch->cap = cap;
+  ch->src = src;
+  ch->bus = tty[src].bus;
+  ch->dest = -1;
+  ch->to_devices = tty[src].role == ROLE_STAR;
+  ch->ctl = tty[src].ctl;
+  ch->src_id = tty[src].id;
+  ch->seq = buses[ch->bus].cur_seq;
+  ch->stamp = now_ns();
+  memcpy(ch->data, buf, size);
+  return ch;
+}
 
-  n = prepare_poll(tty, (struct pollfd **) &wpfd, -1, POLLOUT | POLLHUP);
-  printf("Writing to %d clients: %d bytes\n", n, size);
-  if (n > 1) {
-    pollret = poll(wpfd, n, POLL_W_TIMEOUT);
-    if (pollret < 0) {
-      fprintf(stderr, "Poll error: %s\n", strerror(errno));
-      syslog(LOG_WARNING, "Poll error: %s\n", strerror(errno));
-      sleep(1);
+
+void chunk_put(struct chunk *ch) {
+  if (__atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(ch);
+}
+
+
+/* Stop appending to the open batch chunk */
+void batch_seal(void) {
+  if (batch_chunk) {
+    chunk_put(batch_chunk);
+    batch_chunk = NULL;
+  }
+}
+
+
+void ready_push(int slot) {
+  tty[slot].ready = 1;
+  tty[slot].next_ready = -1;
+  if (ready_tail == -1)
+    ready_head = slot;
+  else
+    tty[ready_tail].next_ready = slot;
+  ready_tail = slot;
+  ready_count++;
+}
+
+
+int ready_pop(void) {
+  int slot = ready_head;
+  ready_head = tty[slot].next_ready;
+  if (ready_head == -1)
+    ready_tail = -1;
+  ready_count--;
+  tty[slot].ready = 0;
+  return slot;
+}
+
+
+/* Whether client c gets what a client sends, as far as roles and channels
+ * go: the control channel and the data never mix. */
+static inline int client_gets(struct tty_client *c, int to_devices, int ctl) {
+  return c->ctl == ctl && c->role != ROLE_TALK && (!to_devices || c->role == ROLE_DEVICE);
+}
+
+
+/* Let the members of a bus held back by a full blocking queue read again, once
+ * there is none left */
+void bus_resume(int b) {
+  struct bus *bus = &buses[b];
+  int m, i;
+
+  if (--bus->stalled > 0)
+    return;
+  for (m = 0; m < bus->nmembers; m++) {
+    i = bus->members[m];
+    if (tty[i].stalled) {
+      tty[i].stalled = 0;
+      if (!tty[i].ready)
+        ready_push(i);
+    }
+  }
+}
+
+
+int outq_push(struct outq *q, struct chunk *ch) {
+  if (q->count == queue_len)
+    return -1;
+  q->ring[(q->head + q->count) % queue_len] = ch;
+  q->count++;
+  __atomic_fetch_add(&ch->refs, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+/* Drop what was written from the queue, accounting for it in the client stats */
+void outq_consume(struct tty_client *c, size_t bytes) {
+  struct outq *q = &c->q;
+  struct chunk *ch;
+  uint64_t now = now_ns(), us;
+  int b, full = q->count == queue_len;
+
+  c->stats.bytes_out += bytes;
+  while (q->count > 0 && bytes > 0) {
+    ch = q->ring[q->head];
+    if (bytes < (size_t) (ch->len - q->off)) {
+      q->off += bytes;
       return;
     }
-    (void) check_poll_errors(wpfd, n, tty);
+    bytes -= ch->len - q->off;
+    q->off = 0;
+    c->stats.chunks_out++;
+    us = (now - ch->stamp) / 1000;
+    for (b = 0; b < LAT_BUCKETS - 1 && us >= (1ULL << b); b++)
+      ;
+    c->stats.latency[b]++;
+    if (ch == batch_chunk)
+      batch_seal();  // this client is done with it: no more appending
+    q->head = (q->head + 1) % queue_len;
+    q->count--;
+    chunk_put(ch);
+  }
+  if (q->count < queue_len - queue_len / 4)
+    c->high_since = 0;
+  if (full && q->count < queue_len && c->policy == POLICY_BLOCK)
+    bus_resume(c->bus);
+}
 
-    for (i = 0; i < n; i++) {
-      if (wpfd[i].revents & POLLOUT && wpfd[i].fd != src)
-        write(wpfd[i].fd, buf, size);
+
+/* Queue a chunk for a client, as its policy says when the queue is full.
+ * Returns -1 if the chunk was not queued. */
+int client_queue(struct tty_client *c, struct chunk *ch) {
+  struct outq *q = &c->q;
+  struct chunk *old;
+  unsigned int at;
+  uint64_t now;
+
+  if (c->policy == POLICY_DISCONNECT && q->count >= queue_len - queue_len / 4) {
+    now = now_ns();
+    if (!c->high_since) {
+      c->high_since = now;
+    } else if (now - c->high_since > (uint64_t) kick_after * 1000000 && !c->dead) {
+      // the reader sees it go, as with a failed write
+      c->dead = 1;
+      c->stats.kicks++;
+      shutdown(c->fd, SHUT_RDWR);
+      return -1;
     }
   }
-  free(wpfd);
+  if (q->count == queue_len && c->policy == POLICY_DROP_OLDEST && (q->off == 0 || queue_len > 1)) {
+    // the head chunk may be half written: then the one after it goes
+    at = (q->head + (q->off ? 1 : 0)) % queue_len;
+    old = q->ring[at];
+    if (q->off)
+      q->ring[at] = q->ring[q->head];
+    q->head = (q->head + 1) % queue_len;
+    q->count--;
+    chunk_put(old);
+    c->stats.drops_old++;
+  }
+  if (outq_push(q, ch) < 0) {
+    counters.drops++;
+    c->stats.drops++;
+    return -1;
+  }
+  if (q->count == queue_len && c->policy == POLICY_BLOCK) {
+    buses[c->bus].stalled++;
+    c->stats.stalls++;
+  }
+  return 0;
 }
 
 
-int main(int argc, char *argv[]) {
-  int n = 0;
-  int listenfd = -1;
-  int i, r = 0;
-  int pollret;
-  struct pollfd *pfd;
-  int *tty;
-  char buffer[BUFFER_SIZE];
-  int daemonize = 0;
+void outq_clear(struct outq *q) {
+  while (q->count > 0) {
+    chunk_put(q->ring[q->head]);
+    q->head = (q->head + 1) % queue_len;
+    q->count--;
+  }
+  q->off = 0;
+}
 
-  pfd = (struct pollfd *) malloc(sizeof(struct pollfd) * (1 + MAX_TTY));
-  tty = (int *) malloc(sizeof(int) * MAX_TTY);
-  if (!pfd || !tty) {
-    fprintf(stderr, "alloc error: %s\n", strerror(errno));
-    syslog(LOG_ERR, "alloc error: %s\n", strerror(errno));
-    exit(4);
+
+/* Main thread side of the worker rings. Chunks are dropped for a whole shard
+ * if its ring is full; client arrivals and departures wait for room. */
+int shard_push(struct worker *w, int type, int slot, struct chunk *ch) {
+  uint64_t one = 1;
+  unsigned int head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+  struct shard_msg *m;
+
+  if (w->tail - head == WORKER_QUEUE)
+    return -1;
+  m = &w->q[w->tail % WORKER_QUEUE];
+  m->type = type;
+  m->slot = slot;
+  m->ch = ch;
+  __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&w->sleeping, 0, __ATOMIC_SEQ_CST))
+    write(w->efd, &one, sizeof(one));
+  return 0;
+}
+
+
+void shard_add(int slot) {
+  struct worker *w = &workers[0];
+  int i;
+
+  for (i = 1; i < nworkers; i++) {
+    if (workers[i].load < w->load)
+      w = &workers[i];
   }
-  while (1) {
-    int c;
-    c = getopt(argc, argv, "dhs:");
-    if (c == -1)
-      break;
+  w->load++;
+  tty[slot].worker = w - workers;
+  while (shard_push(w, SHARD_ADD, slot, NULL) < 0)
+    sched_yield();
+}
 
-    switch (c) {
-      case 'd':
-        daemonize = 1;
-        break;
-      case 'h':
-        usage(argv[0]);  // implies exit
-        break;
-      case 's':
-        tty_bus_path = strdup(optarg);
-        break;
-      default:
-        usage(argv[0]);  // implies exit
+
+/* The worker closes the fd once it has processed everything queued before
+ * this, and hands the slot back through release_head. */
+void shard_del(int slot) {
+  struct worker *w = &workers[tty[slot].worker];
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, tty[slot].fd, NULL);
+  tty[slot].closing = 1;
+  if (tty[slot].ring_slot >= 0)
+    ring_release(&buses[tty[slot].bus].ring, tty[slot].ring_slot);
+  nclients--;
+  w->load--;
+  while (shard_push(w, SHARD_DEL, slot, NULL) < 0)
+    sched_yield();
+}
+
+
+void shard_publish(int src, char *buf, int size) {
+  struct chunk *ch = chunk_new(src, buf, size, size);
+  int i;
+
+  if (!ch)
+    return;
+  for (i = 0; i < nworkers; i++) {
+    __atomic_fetch_add(&ch->refs, 1, __ATOMIC_RELAXED);
+    if (shard_push(&workers[i], SHARD_CHUNK, src, ch) < 0) {
+      chunk_put(ch);
+      counters.drops++;
     }
   }
-  if (optind < argc)
-    usage(argv[0]);  // implies exit
+  chunk_put(ch);
+}
 
-  if (daemonize)
-    daemon(0, 0);
 
-  if (!tty_bus_path)
-    tty_bus_path = strdup("/tmp/ttybus");
+/* Put the slots released by workers back on the free list */
+void shard_reclaim(void) {
+  int slot;
 
-  fprintf(stderr, "Creating bus: %s\n", tty_bus_path);
-  syslog(LOG_INFO, "Creating bus: %s\n", tty_bus_path);
+  pthread_mutex_lock(&release_lock);
+  while (release_head != -1) {
+    slot = release_head;
+    release_head = tty[slot].next_free;
+    tty[slot].closing = 0;
+    tty[slot].next_free = free_head;
+    free_head = slot;
+  }
+  pthread_mutex_unlock(&release_lock);
+}
 
-  atexit(exiting);
-  sigset(SIGTERM, signaled);
-  sigset(SIGINT, signaled);
 
-  init_dev_array((int **) &tty);
-  listenfd = bus_init(tty_bus_path);
-  if (listenfd < 0) {
-    fprintf(stderr, "Cannot bind to %s: %s\n", tty_bus_path, strerror(errno));
-    syslog(LOG_ERR, "Cannot bind to %s: %s\n", tty_bus_path, strerror(errno));
-    exit(1);
+int bus_join(int slot, int b) {
+  struct bus *bus = &buses[b];
+  int *m, size;
+
+  if (bus->nmembers == bus->members_size) {
+    size = bus->members_size ? bus->members_size * 2 : TTY_INIT;
+    m = realloc(bus->members, sizeof(int) * size);
+    if (!m)
+      return -1;
+    bus->members = m;
+    bus->members_size = size;
   }
-  for (;;) {
-    n = prepare_poll(tty, (struct pollfd **) &pfd, listenfd, POLLIN | POLLHUP);
-    pollret = poll(pfd, n, POLL_R_TIMEOUT);
-    if (pollret < 0) {
-      fprintf(stderr, "Poll error: %s, n is %d\n", strerror(errno), n);
-      syslog(LOG_WARNING, "Poll error: %s, n is %d\n", strerror(errno), n);
-      sleep(1);
-      continue;
-    }
-    if (check_poll_errors(pfd, n, tty) > 0)
-      continue;
+  tty[slot].bus = b;
+  tty[slot].bus_member = bus->nmembers;
+  bus->members[bus->nmembers++] = slot;
+  return 0;
+}
+
+
+void stats_add(struct client_stats *to, struct client_stats *from) {
+  int b;
+
+  to->chunks_in += from->chunks_in;
+  to->bytes_in += from->bytes_in;
+  to->chunks_out += from->chunks_out;
+  to->bytes_out += from->bytes_out;
+  to->drops += from->drops;
+  to->drops_old += from->drops_old;
+  to->stalls += from->stalls;
+  to->kicks += from->kicks;
+  for (b = 0; b < LAT_BUCKETS; b++)
+    to->latency[b] += from->latency[b];
+}
+
+
+void bus_leave(int slot) {
+  struct bus *bus = &buses[tty[slot].bus];
+  int last = bus->members[--bus->nmembers];
+
+  stats_add(&bus->gone, &tty[slot].stats);
+  if (tty[slot].filter)
+    bus->nfiltered--;
+  bus->members[tty[slot].bus_member] = last;
+  tty[last].bus_member = tty[slot].bus_member;
+  if (tty[slot].policy == POLICY_BLOCK)
+    bus->nblocking--;
+  if (tty[slot].policy == POLICY_BLOCK && tty[slot].q.count == queue_len)
+    bus_resume(tty[slot].bus);
+}
+
 
-    if (pfd[0].revents & POLLIN) {
-      struct sockaddr_un cliaddr;
-      socklen_t len = sizeof(struct sockaddr_un);
-      int connfd = accept(listenfd, (struct sockaddr *) &cliaddr, &len);
-      if (connfd == -1) {
-        bus_destroy(listenfd, tty_bus_path);
-        listenfd = bus_init(tty_bus_path);
+/* Add comma separated patterns to f. Patterns may use %XX hex escapes, for
+ * spaces, commas... */
+void patterns_parse(struct line_filter *f, char *list, int anywhere) {
+  char *pat, *save = NULL, *in, *out;
+  unsigned int x;
+
+  for (pat = strtok_r(list, ",", &save); pat && f->n < MAX_FILTERS; pat = strtok_r(NULL, ",", &save)) {
+    for (in = out = pat; *in; out++) {
+      if (in[0] == '%' && isxdigit((unsigned char) in[1]) && isxdigit((unsigned char) in[2]) && sscanf(in + 1, "%2x", &x) == 1) {
+        *out = x;
+        in += 3;
       } else {
-        for (i = 0; i < MAX_TTY; i++)
-          if (tty[i] == -1) {
-            tty[i] = connfd;
-            break;
-          }
+        *out = *in++;
       }
+    }
+    if (out == pat)
       continue;
+    f->pat[f->n] = malloc(out - pat);
+    memcpy(f->pat[f->n], pat, out - pat);
+    f->len[f->n] = out - pat;
+    f->anywhere[f->n++] = anywhere;
+  }
+}
+
+
+void patterns_free(struct line_filter *f) {
+  while (f->n > 0)
+    free(f->pat[--f->n]);
+  free(f);
+}
+
+
+/* Returns the slot the client got, -1 if it was refused */
+int client_add(int connfd, int b) {
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+  int i;
+
+  if (nclients >= max_clients || (free_head == -1 && tty_grow() < 0)) {
+    counters.rejects++;
+    fprintf(stderr, "Too many clients (%d), refusing connection\n", nclients);
+    syslog(LOG_WARNING, "Too many clients (%d), refusing connection\n", nclients);
+    close(connfd);
+    return -1;
+  }
+  i = free_head;
+  if (!tty[i].q.ring)
+    tty[i].q.ring = malloc(sizeof(struct chunk *) * queue_len);
+  // with workers, the main thread only reads: they watch for EPOLLOUT
+  if (!tty[i].q.ring || event_add(connfd, i, nworkers ? EPOLLIN | EPOLLRDHUP : EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0 ||
+      bus_join(i, b) < 0) {
+    close(connfd);  // also drops it from the epoll set
+    return -1;
+  }
+  free_head = tty[i].next_free;
+  nclients++;
+  if (i >= tty_top)
+    tty_top = i + 1;
+  tty[i].fd = connfd;
+  tty[i].id = next_client_id++;
+  tty[i].blocked = 0;
+  tty[i].fresh = 1;
+  tty[i].pkt = bus_type == SOCK_SEQPACKET;
+  tty[i].policy = buses[b].policy;
+  tty[i].role = ROLE_BOTH;
+  tty[i].ctl = 0;
+  if (tty[i].policy == POLICY_BLOCK)
+    buses[b].nblocking++;
+  tty[i].stalled = 0;
+  tty[i].high_since = 0;
+  tty[i].dead = 0;
+  tty[i].ring_slot = -1;
+  tty[i].pid = 0;
+  tty[i].name = NULL;
+  tty[i].fake = NULL;
+  // the slot is no longer in any worker's hands: the old filter can go
+  if (tty[i].filter) {
+    patterns_free(tty[i].filter);
+    tty[i].filter = NULL;
+  }
+  tty[i].line_len = 0;
+  memset(&tty[i].stats, 0, sizeof(tty[i].stats));
+  if (getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0)
+    tty[i].pid = cred.pid;
+  if (nworkers > 0)
+    shard_add(i);
+  return i;
+}
+
+
+/* The slot may still sit on the ready list: it is skipped there while free,
+ * and simply inherited by the next client that takes the slot. */
+void client_del(int slot) {
+  bus_leave(slot);
+  if (nworkers > 0) {
+    shard_del(slot);
+    return;
+  }
+  close(tty[slot].fd);  // also drops it from the epoll set
+  tty[slot].fd = -1;
+  outq_clear(&tty[slot].q);
+  if (tty[slot].ring_slot >= 0)
+    ring_release(&buses[tty[slot].bus].ring, tty[slot].ring_slot);
+  tty[slot].next_free = free_head;
+  free_head = slot;
+  nclients--;
+}
+
+
+/* Packet clients: one message per chunk, its header in front, as many of
+ * them as the socket takes in one sendmmsg(). */
+int client_flush_pkts(struct tty_client *c) {
+  struct ttybus_pkt_hdr hdr[FLUSH_IOV];
+  struct mmsghdr msgs[FLUSH_IOV];
+  struct iovec iov[FLUSH_IOV][2];
+  struct outq *q = &c->q;
+  unsigned int i, n;
+  size_t bytes;
+  int w;
+
+  while (q->count > 0) {
+    n = q->count < FLUSH_IOV ? q->count : FLUSH_IOV;
+    memset(msgs, 0, sizeof(struct mmsghdr) * n);
+    for (i = 0; i < n; i++) {
+      struct chunk *ch = q->ring[(q->head + i) % queue_len];
+      hdr[i].src = ch->src_id;
+      hdr[i].seq = ch->seq;
+      iov[i][0].iov_base = &hdr[i];
+      iov[i][0].iov_len = sizeof(hdr[i]);
+      iov[i][1].iov_base = ch->data;
+      iov[i][1].iov_len = ch->len;
+      msgs[i].msg_hdr.msg_iov = iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 2;
     }
-    if (pollret > 0) {
-      for (;;) {
-        if (pfd[i].revents & POLLIN) {
-          r = read(pfd[i].fd, buffer, BUFFER_SIZE);
-          if (r > 0)
-            recvbuff(pfd[i].fd, buffer, r, tty);
-          break;
-        }
-        if (++i >= n)
-          i = 1;
+    w = sendmmsg(c->fd, msgs, n, MSG_DONTWAIT);
+    counters.writes++;
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;  // nothing written: an edge-triggered fd won't tell again
+      if (errno == EAGAIN) {
+        c->blocked = 1;
+        return 0;
+      }
+      return -1;
+    }
+    for (bytes = 0, i = 0; i < (unsigned int) w; i++)
+      bytes += q->ring[(q->head + i) % queue_len]->len;
+    outq_consume(c, bytes);
+    if ((unsigned int) w < n) {
+      c->blocked = 1;
+      return 0;
+    }
+  }
+  c->blocked = 0;
+  return 0;
+}
+
+
+/* Write as much of the output queue as the fd takes without blocking.
+ * Returns -1 if the client has gone away. */
+int client_flush(struct tty_client *c) {
+  struct iovec iov[FLUSH_IOV];
+  struct outq *q = &c->q;
+  unsigned int i, n;
+  ssize_t w;
+
+  if (c->dead)
+    return 0;
+  if (c->pkt)
+    return client_flush_pkts(c);
+  while (q->count > 0) {
+    n = q->count < FLUSH_IOV ? q->count : FLUSH_IOV;
+    for (i = 0; i < n; i++) {
+      struct chunk *ch = q->ring[(q->head + i) % queue_len];
+      iov[i].iov_base = ch->data;
+      iov[i].iov_len = ch->len;
+    }
+    iov[0].iov_base = (char *) iov[0].iov_base + q->off;
+    iov[0].iov_len -= q->off;
+    w = writev(c->fd, iov, n);
+    counters.writes++;
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;  // nothing written: an edge-triggered fd won't tell again
+      if (errno == EAGAIN) {
+        c->blocked = 1;
+        return 0;
       }
+      return -1;
+    }
+    outq_consume(c, w);
+  }
+  c->blocked = 0;
+  return 0;
+}
+
+
+/* Flush every client with something queued, when the batch deadline expires
+ * or enough bytes are pending: each of them gets a single writev(). */
+void batch_flush(void) {
+  struct itimerspec off;
+  int i;
+
+  batch_seal();
+  batch_bytes = 0;
+  if (batch_armed) {
+    memset(&off, 0, sizeof(off));
+    timerfd_settime(batch_timerfd, 0, &off, NULL);
+    batch_armed = 0;
+  }
+  counters.flushes++;
+  for (i = 0; i < tty_top; i++) {
+    if (tty[i].fd != -1 && tty[i].q.count > 0 && !tty[i].blocked && client_flush(&tty[i]) < 0)
+      client_del(i);
+  }
+}
+
+
+void batch_add(int src, char *buf, int size) {
+  struct bus *bus = &buses[tty[src].bus];
+  struct itimerspec when;
+  struct chunk *ch = batch_chunk;
+  int i, m;
+
+  // on a packet bus, every write stays a chunk, and a message, of its own
+  if (ch && ch->src == src && bus_type == SOCK_STREAM && ch->cap - ch->len >= size) {
+    // every queue holding the open chunk gets the new bytes too
+    memcpy(ch->data + ch->len, buf, size);
+    ch->len += size;
+  } else {
+    batch_seal();
+    ch = chunk_new(src, buf, size, BUFFER_SIZE);
+    if (!ch)
+      return;
+    for (m = 0; m < bus->nmembers; m++) {
+      i = bus->members[m];
+      if (i == src || tty[i].ring_slot >= 0 || tty[i].filter || !client_gets(&tty[i], ch->to_devices, ch->ctl))
+        continue;
+      client_queue(&tty[i], ch);
     }
+    batch_chunk = ch;  // keeps the creation reference until sealed
+  }
+  batch_bytes += size;
+  if (batch_bytes >= batch_threshold) {
+    batch_flush();
+  } else if (!batch_armed) {
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = batch_window / 1000000;
+    when.it_value.tv_nsec = (batch_window % 1000000) * 1000;
+    timerfd_settime(batch_timerfd, 0, &when, NULL);
+    batch_armed = 1;
   }
-}
\ No newline at end of file
+}
+
+
+/* Start a new capture file, moving the previous ones one number up */
+int capture_open(struct capture *cap, char *bus_path) {
+  char from[PATH_MAX], to[PATH_MAX];
+  struct timespec mono, real;
+  int i;
+
+  capture_close(cap);
+  for (i = cap_files - 1; i > 0; i--) {
+    if (i == 1)
+      snprintf(from, sizeof(from), "%s", cap->path);
+    else
+      snprintf(from, sizeof(from), "%s.%d", cap->path, i - 1);
+    snprintf(to, sizeof(to), "%s.%d", cap->path, i);
+    rename(from, to);
+  }
+  cap->fd = open(cap->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (cap->fd < 0 || ftruncate(cap->fd, cap_size) < 0) {
+    fprintf(stderr, "Cannot create capture file %s: %s\n", cap->path, strerror(errno));
+    syslog(LOG_ERR, "Cannot create capture file %s: %s\n", cap->path, strerror(errno));
+    return -1;
+  }
+  cap->map = mmap(NULL, cap_size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+  if (cap->map == MAP_FAILED) {
+    cap->map = NULL;
+    fprintf(stderr, "Cannot map capture file %s: %s\n", cap->path, strerror(errno));
+    syslog(LOG_ERR, "Cannot map capture file %s: %s\n", cap->path, strerror(errno));
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  cap->hdr = (struct ttybus_cap_hdr *) cap->map;
+  memcpy(cap->hdr->magic, TTYBUS_CAP_MAGIC, sizeof(cap->hdr->magic));
+  cap->hdr->hdr_size = TTYBUS_CAP_HDR_SIZE;
+  cap->hdr->seq = cap->seq++;
+  cap->hdr->size = cap_size;
+  cap->hdr->end = TTYBUS_CAP_HDR_SIZE;
+  cap->hdr->start_mono = (uint64_t) mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+  cap->hdr->start_real = (uint64_t) real.tv_sec * 1000000000ULL + real.tv_nsec;
+  snprintf(cap->hdr->bus, sizeof(cap->hdr->bus), "%s", bus_path);
+  return 0;
+}
+
+
+void capture_write(struct bus *bus, uint32_t src, char *buf, int size) {
+  struct capture *cap = bus->cap;
+  struct ttybus_cap_rec rec;
+  uint64_t end;
+  size_t reclen = (sizeof(rec) + size + TTYBUS_CAP_ALIGN - 1) & ~(TTYBUS_CAP_ALIGN - 1);
+
+  if (!cap->map)
+    return;  // gave up after an error
+  if (cap->hdr->end + reclen > cap_size && capture_open(cap, bus->path) < 0) {
+    capture_close(cap);
+    return;
+  }
+  end = cap->hdr->end;
+  rec.time = now_ns();
+  rec.src = src;
+  rec.len = size;
+  memcpy(cap->map + end, &rec, sizeof(rec));
+  memcpy(cap->map + end + sizeof(rec), buf, size);
+  cap->hdr->records++;
+  __atomic_store_n(&cap->hdr->end, end + reclen, __ATOMIC_RELEASE);
+}
+
+
+/* Whether a line starts with one of the prefixes or contains one of the patterns */
+int filter_match(struct line_filter *f, char *line, int len) {
+  int i;
+
+  for (i = 0; i < f->n; i++) {
+    if (f->anywhere[i] ? memmem(line, len, f->pat[i], f->len[i]) != NULL
+                       : len >= f->len[i] && memcmp(line, f->pat[i], f->len[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+
+/* Send a filtered chunk to member i. Returns -1 if i has gone away. */
+int filter_send(int src, int i, struct chunk *ch) {
+  int r = 0;
+
+  ch->dest = i;
+  if (nworkers > 0) {
+    if (shard_push(&workers[tty[i].worker], SHARD_CHUNK, src, ch) < 0) {
+      chunk_put(ch);
+      counters.drops++;
+    }
+    return 0;
+  }
+  if (client_queue(&tty[i], ch) == 0 && batch_window == 0 && !tty[i].blocked && client_flush(&tty[i]) < 0) {
+    client_del(i);
+    r = -1;
+  }
+  chunk_put(ch);
+  return r;
+}
+
+
+/* Give the complete lines of what src sent to the members with a filter, each
+ * one getting the lines its filter matches in a chunk for it alone. A line
+ * cut between two reads waits in src's line buffer for its end, or until the
+ * buffer is full. */
+void filter_fanout(int src, char *buf, int size) {
+  static struct {
+    char *p;
+    int len;
+  } lines[BUFFER_SIZE + 1];
+  struct bus *bus = &buses[tty[src].bus];
+  struct tty_client *c = &tty[src];
+  char *end = buf + size, *nl;
+  int nlines = 0, i, m, l, len, done, r;
+  struct chunk *ch;
+
+  if (!c->line && !(c->line = malloc(BUFFER_SIZE)))
+    return;
+  if (c->line_len > 0) {
+    nl = memchr(buf, '\n', size);
+    len = nl ? nl + 1 - buf : size;
+    done = nl != NULL;
+    if (len >= BUFFER_SIZE - c->line_len) {
+      len = BUFFER_SIZE - c->line_len;
+      done = 1;
+    }
+    memcpy(c->line + c->line_len, buf, len);
+    c->line_len += len;
+    buf += len;
+    if (!done)
+      return;
+    lines[nlines].p = c->line;
+    lines[nlines++].len = c->line_len;
+  }
+  // memchr() looks at a vector of bytes at a time
+  for (; buf < end && (nl = memchr(buf, '\n', end - buf)) != NULL; buf = nl + 1) {
+    lines[nlines].p = buf;
+    lines[nlines++].len = nl + 1 - buf;
+  }
+
+  for (m = bus->nmembers - 1; m >= 0; m--) {
+    i = bus->members[m];
+    if (i == src || !tty[i].filter || !client_gets(&tty[i], tty[src].role == ROLE_STAR, 0))
+      continue;
+    ch = NULL;
+    for (l = 0; l < nlines; l++) {
+      if (!filter_match(tty[i].filter, lines[l].p, lines[l].len))
+        continue;
+      // on a packet bus, a chunk is a message, which can't outgrow TTYBUS_PKT_MAX
+      if (ch && bus_type != SOCK_STREAM && ch->len + lines[l].len > TTYBUS_PKT_MAX) {
+        r = filter_send(src, i, ch);
+        ch = NULL;
+        if (r < 0)
+          break;
+      }
+      if (!ch && !(ch = chunk_new(src, lines[l].p, 0, size + BUFFER_SIZE)))
+        break;
+      memcpy(ch->data + ch->len, lines[l].p, lines[l].len);
+      ch->len += lines[l].len;
+    }
+    if (ch)
+      filter_send(src, i, ch);
+  }
+
+  // the rest of the line has yet to come
+  c->line_len = end - buf;
+  memmove(c->line, buf, c->line_len);
+}
+
+
+/* Queue a chunk for a single client, the devices or the control channel,
+ * and write it out right away: nobody waits on a batch for these. */
+void chunk_deliver(struct chunk *ch) {
+  struct bus *bus = &buses[ch->bus];
+  int i, m;
+
+  if (nworkers > 0) {
+    for (i = 0; i < nworkers; i++) {
+      if (ch->dest >= 0 && i != tty[ch->dest].worker)
+        continue;
+      __atomic_fetch_add(&ch->refs, 1, __ATOMIC_RELAXED);
+      if (shard_push(&workers[i], SHARD_CHUNK, ch->src, ch) < 0) {
+        chunk_put(ch);
+        counters.drops++;
+      }
+    }
+    return;
+  }
+  for (m = bus->nmembers - 1; m >= 0; m--) {
+    i = bus->members[m];
+    if ((ch->dest >= 0 ? i != ch->dest : i == ch->src) || !client_gets(&tty[i], ch->to_devices, ch->ctl))
+      continue;
+    if (client_queue(&tty[i], ch) == 0 && !tty[i].blocked && client_flush(&tty[i]) < 0)
+      client_del(i);
+  }
+}
+
+
+/* Transaction buses (--transact): what clients send is a request for the
+ * device endpoints, passed on one request at a time, and what the devices send
+ * while a request is in progress is its reply, for the requester only. What a
+ * client sends before the reply starts, or while its request waits, is part
+ * of its request; the reply ends with one of the bus terminators, or once the
+ * line stays silent. */
+static int client_is(int slot, uint32_t id) {
+  return tty[slot].fd != -1 && !tty[slot].closing && tty[slot].id == id;
+}
+
+
+void txn_arm(uint64_t when) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = when / 1000000000ULL;
+  its.it_value.tv_nsec = when % 1000000000ULL;
+  timerfd_settime(txn_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+  txn_armed = when;
+}
+
+
+/* Push the end of the transaction back after some traffic. The timer only
+ * ever moves earlier here: when it goes off, txn_expire() sets it again. */
+void txn_touch(struct bus *bus) {
+  bus->deadline = now_ns() + (bus->replied ? (uint64_t) reply_gap * 1000 : (uint64_t) reply_timeout * 1000000);
+  if (!txn_armed || bus->deadline < txn_armed)
+    txn_arm(bus->deadline);
+}
+
+
+void txn_start(struct bus *bus, struct chunk *ch) {
+  bus->owner = ch->src;
+  bus->owner_id = ch->src_id;
+  bus->replied = 0;
+  bus->tail_len = 0;
+  bus->transactions++;
+  chunk_deliver(ch);
+  chunk_put(ch);
+  txn_touch(bus);
+}
+
+
+/* Pass the next request on, skipping those of clients that left meanwhile */
+void txn_end(struct bus *bus) {
+  struct chunk *ch;
+
+  bus->owner = -1;
+  while (bus->txq_count > 0) {
+    ch = bus->txq[bus->txq_head];
+    bus->txq_head = (bus->txq_head + 1) % TXN_QUEUE;
+    bus->txq_count--;
+    if (client_is(ch->src, ch->src_id)) {
+      txn_start(bus, ch);
+      return;
+    }
+    chunk_put(ch);
+  }
+}
+
+
+/* Whether the reply ends in what was just read, looking at the end of what
+ * came before too */
+int txn_done(struct bus *bus, char *buf, int size) {
+  struct line_filter *t = bus->terms;
+  char join[2 * TXN_TAIL];
+  int i, n = size < TXN_TAIL ? size : TXN_TAIL, len, done = 0;
+
+  memcpy(join, bus->tail, bus->tail_len);
+  memcpy(join + bus->tail_len, buf, n);
+  len = bus->tail_len + n;
+  for (i = 0; t && i < t->n && !done; i++)
+    done = memmem(buf, size, t->pat[i], t->len[i]) || memmem(join, len, t->pat[i], t->len[i]);
+  if (size >= TXN_TAIL) {
+    memcpy(bus->tail, buf + size - TXN_TAIL, TXN_TAIL);
+    bus->tail_len = TXN_TAIL;
+  } else {
+    bus->tail_len = len < TXN_TAIL ? len : TXN_TAIL;
+    memcpy(bus->tail, join + len - bus->tail_len, bus->tail_len);
+  }
+  return done;
+}
+
+
+/* End the transactions the line has been silent for too long on */
+void txn_expire(void) {
+  uint64_t now = now_ns(), next = 0;
+  int b;
+
+  txn_armed = 0;
+  for (b = 0; b < nbuses; b++) {
+    if (!buses[b].path || buses[b].owner < 0)
+      continue;
+    if (buses[b].deadline <= now) {
+      if (!buses[b].replied)
+        buses[b].noreply++;
+      txn_end(&buses[b]);
+    }
+    if (buses[b].owner >= 0 && (!next || buses[b].deadline < next))
+      next = buses[b].deadline;
+  }
+  if (next)
+    txn_arm(next);
+}
+
+
+/* Add what a client sent to its request waiting in the queue, if it has one */
+int txn_append(struct bus *bus, int src, char *buf, int size) {
+  struct chunk *ch, *grown;
+  int i, q;
+
+  for (i = 0; i < bus->txq_count; i++) {
+    q = (bus->txq_head + i) % TXN_QUEUE;
+    ch = bus->txq[q];
+    if (ch->src != src || ch->src_id != tty[src].id)
+      continue;
+    if (ch->cap - ch->len < size) {
+      grown = chunk_new(src, ch->data, ch->len, 2 * (ch->len + size));
+      if (!grown)
+        return 1;
+      grown->to_devices = 1;
+      grown->seq = ch->seq;
+      chunk_put(ch);
+      bus->txq[q] = ch = grown;
+    }
+    memcpy(ch->data + ch->len, buf, size);
+    ch->len += size;
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Route what src sent on a transaction bus. Returns 0 for what is broadcast
+ * as usual: what the devices send with no request in progress, and anything
+ * on a bus without devices. */
+int txn_route(int src, char *buf, int size) {
+  struct bus *bus = &buses[tty[src].bus];
+  struct chunk *ch;
+  int m;
+
+  if (tty[src].role == ROLE_DEVICE) {
+    if (bus->owner < 0)
+      return 0;
+    // the requester may have left: its reply goes nowhere
+    if (client_is(bus->owner, bus->owner_id) && (ch = chunk_new(src, buf, size, size)) != NULL) {
+      ch->dest = bus->owner;
+      chunk_deliver(ch);
+      chunk_put(ch);
+    }
+    bus->replied = 1;
+    if (txn_done(bus, buf, size))
+      txn_end(bus);
+    else
+      txn_touch(bus);
+    return 1;
+  }
+  for (m = 0; m < bus->nmembers && (tty[bus->members[m]].role != ROLE_DEVICE || tty[bus->members[m]].ctl); m++)
+    ;
+  if (m == bus->nmembers)
+    return 0;
+  if (bus->txq_count > 0 && txn_append(bus, src, buf, size))
+    return 1;
+  ch = chunk_new(src, buf, size, size);
+  if (!ch)
+    return 1;
+  ch->to_devices = 1;
+  if (bus->owner < 0) {
+    txn_start(bus, ch);
+  } else if (bus->owner == src && bus->owner_id == ch->src_id && !bus->replied) {
+    chunk_deliver(ch);
+    chunk_put(ch);
+    txn_touch(bus);
+  } else if (bus->txq_count == TXN_QUEUE) {
+    tty[src].stats.drops++;
+    chunk_put(ch);
+  } else {
+    bus->txq[(bus->txq_head + bus->txq_count++) % TXN_QUEUE] = ch;
+  }
+  return 1;
+}
+
+
+/* Queue one shared copy of the chunk on every other client of the bus. The
+ * write side never waits: clients that can't keep up drop the chunk when their
+ * queue is full, and queues are flushed as their fds become writable. */
+void recvbuff(int src, char *buf, int size) {
+  struct bus *bus = &buses[tty[src].bus];
+  struct chunk *ch;
+  int i, m;
+
+  if (tty[src].role == ROLE_LISTEN)
+    return;
+  if (tty[src].ctl) {
+    // out of band: not counted, numbered, recorded, filtered or part of a transaction
+    if ((ch = chunk_new(src, buf, size, size)) != NULL) {
+      chunk_deliver(ch);
+      chunk_put(ch);
+    }
+    return;
+  }
+
+  // one number per read, whatever copies of it the clients get
+  bus->cur_seq = bus->seq++;
+  bus->chunks++;
+  bus->bytes += size;
+  if (bus->ring.memfd >= 0)
+    ring_publish(&bus->ring, tty[src].id, buf, size);
+  if (bus->cap)
+    capture_write(bus, tty[src].id, buf, size);
+  if (bus->transact && txn_route(src, buf, size))
+    return;
+  if (bus->nfiltered > 0)
+    filter_fanout(src, buf, size);
+  if (batch_window > 0) {
+    batch_add(src, buf, size);
+    return;
+  }
+  if (nworkers > 0) {
+    shard_publish(src, buf, size);
+    return;
+  }
+  ch = chunk_new(src, buf, size, size);
+  if (!ch)
+    return;
+  for (m = bus->nmembers - 1; m >= 0; m--) {
+    // walked backwards: client_del() moves the last member into the hole
+    i = bus->members[m];
+    if (i == src || tty[i].ring_slot >= 0 || tty[i].filter || !client_gets(&tty[i], ch->to_devices, ch->ctl))
+      continue;
+    if (client_queue(&tty[i], ch) < 0)
+      continue;
+    if (!tty[i].blocked && client_flush(&tty[i]) < 0)
+      client_del(i);
+  }
+  chunk_put(ch);
+}
+
+
+/* Worker side: same queueing and flushing as the single-threaded fan-out,
+ * over the clients of this shard only. A client whose write fails is shut
+ * down, so the main thread sees it go away and sends SHARD_DEL. */
+void shard_fanout(struct worker *w, struct chunk *ch) {
+  struct tty_client *c;
+  int i;
+
+  for (i = 0; i < w->nmembers; i++) {
+    c = &tty[w->members[i]];
+    if (w->members[i] == ch->src || c->bus != ch->bus || c->dead ||
+        __atomic_load_n(&c->ring_slot, __ATOMIC_RELAXED) >= 0 || !client_gets(c, ch->to_devices, ch->ctl))
+      continue;
+    if (ch->dest >= 0 ? w->members[i] != ch->dest : __atomic_load_n(&c->filter, __ATOMIC_RELAXED) != NULL)
+      continue;
+    if (client_queue(c, ch) < 0)
+      continue;
+    if (!c->blocked && client_flush(c) < 0) {
+      c->dead = 1;
+      outq_clear(&c->q);
+      shutdown(c->fd, SHUT_RDWR);
+    }
+  }
+}
+
+
+void shard_process(struct worker *w, struct shard_msg *m) {
+  struct tty_client *c = &tty[m->slot];
+  struct epoll_event ev;
+
+  switch (m->type) {
+    case SHARD_CHUNK:
+      shard_fanout(w, m->ch);
+      chunk_put(m->ch);
+      break;
+    case SHARD_ADD:
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLOUT | EPOLLET;
+      ev.data.u32 = m->slot;
+      epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+      c->blocked = 0;
+      c->member = w->nmembers;
+      w->members[w->nmembers++] = m->slot;
+      break;
+    case SHARD_DEL:
+      w->members[c->member] = w->members[--w->nmembers];
+      tty[w->members[c->member]].member = c->member;
+      outq_clear(&c->q);
+      close(c->fd);
+      c->fd = -1;
+      pthread_mutex_lock(&release_lock);
+      c->next_free = release_head;
+      release_head = m->slot;
+      pthread_mutex_unlock(&release_lock);
+      break;
+  }
+}
+
+
+void *worker_main(void *arg) {
+  struct worker *w = arg;
+  struct epoll_event events[MAX_EVENTS];
+  struct tty_client *c;
+  uint64_t v;
+  unsigned int head;
+  int i, n;
+
+  w->counters = &counters;
+  for (;;) {
+    while ((head = w->head) != __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+      shard_process(w, &w->q[head % WORKER_QUEUE]);
+      __atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) != w->head) {
+      __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+    __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+    counters.wakeups++;
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u32 == WAKE_SLOT) {
+        read(w->efd, &v, sizeof(v));
+        continue;
+      }
+      // stale events for a slot deleted meanwhile at most cause a spare flush
+      c = &tty[events[i].data.u32];
+      if (c->fd != -1 && c->worker == w - workers && c->blocked && client_flush(c) < 0) {
+        c->dead = 1;
+        outq_clear(&c->q);
+        shutdown(c->fd, SHUT_RDWR);
+      }
+    }
+  }
+  return NULL;
+}
+
+
+int workers_start(int n) {
+  struct epoll_event ev;
+  sigset_t all, old;
+  int i;
+
+  workers = calloc(n, sizeof(struct worker));
+  if (!workers)
+    return -1;
+  // signals are for the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i = 0; i < n; i++) {
+    struct worker *w = &workers[i];
+    w->q = malloc(sizeof(struct shard_msg) * WORKER_QUEUE);
+    w->members = malloc(sizeof(int) * max_clients);
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!w->q || !w->members || w->epfd < 0 || w->efd < 0)
+      return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = WAKE_SLOT;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &ev) < 0 || pthread_create(&w->thread, NULL, worker_main, w) != 0)
+      return -1;
+    nworkers++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  // wait for the workers to publish their counters
+  for (i = 0; i < n; i++) {
+    while (!__atomic_load_n(&workers[i].counters, __ATOMIC_ACQUIRE))
+      sched_yield();
+  }
+  return 0;
+}
+
+
+/* Add the patterns of a "prefix=" or "match=" option to the client filter */
+int filter_parse(struct tty_client *c, char *list, int anywhere) {
+  struct line_filter *f = c->filter;
+
+  if (!f && !(f = calloc(1, sizeof(struct line_filter))))
+    return -1;
+  patterns_parse(f, list, anywhere);
+  if (!c->filter) {
+    buses[c->bus].nfiltered++;
+    __atomic_store_n(&c->filter, f, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+
+int policy_parse(const char *name) {
+  int p;
+
+  for (p = 0; p < POLICY_COUNT; p++) {
+    if (strcmp(name, policy_names[p]) == 0)
+      return p;
+  }
+  return -1;
+}
+
+
+/* A client asking for its own policy in its hello. Blocking the bus is only
+ * possible with the single-threaded fan-out. */
+void client_policy(struct tty_client *c, int policy) {
+  struct bus *bus = &buses[c->bus];
+  int full = c->q.count == queue_len;
+
+  if (policy < 0 || (policy == POLICY_BLOCK && nworkers > 0))
+    return;
+  if (c->policy == POLICY_BLOCK) {
+    bus->nblocking--;
+    if (full)
+      bus_resume(c->bus);
+  }
+  c->policy = policy;
+  if (policy == POLICY_BLOCK) {
+    bus->nblocking++;
+    if (full)
+      bus->stalled++;
+  }
+}
+
+
+/* Handle the options of a hello line. */
+void client_hello(struct tty_client *c, char *opts, int passed_fd) {
+  char *opt, *save = NULL;
+  int r;
+
+  for (opt = strtok_r(opts, " ", &save); opt; opt = strtok_r(NULL, " ", &save)) {
+    if (strncmp(opt, "role=", 5) == 0) {
+      for (r = 0; r < ROLE_COUNT && strcmp(opt + 5, role_names[r]) != 0; r++)
+        ;
+      if (r < ROLE_COUNT)
+        c->role = r;
+    } else if (strcmp(opt, "ctl") == 0) {
+      c->ctl = 1;
+    } else if (strncmp(opt, "policy=", 7) == 0) {
+      client_policy(c, policy_parse(opt + 7));
+    } else if (strncmp(opt, "prefix=", 7) == 0) {
+      filter_parse(c, opt + 7, 0);
+    } else if (strncmp(opt, "match=", 6) == 0) {
+      filter_parse(c, opt + 6, 1);
+    } else if (strcmp(opt, "ring") == 0) {
+      // the ring carries everything: a talk-only client has no use for it, and
+      // transactions would not be routed there
+      if (c->role != ROLE_TALK && !c->ctl && !buses[c->bus].transact && ring_subscribe(c, passed_fd) == 0) {
+        passed_fd = -1;
+      } else {
+        ttybus_hello(c->fd, "noring", -1, NULL, 0, NULL);
+      }
+    }
+  }
+  if (passed_fd >= 0)
+    close(passed_fd);
+}
+
+
+/* read() for clients; the first read of a connection also looks for a hello
+ * line, and the fd the client may have passed along with it. */
+/* Describe the line settings of a fake tty in a control channel line */
+void termios_line(struct termios2 *t, char *line, int len) {
+  snprintf(line, len, TTYBUS_CTL_TERMIOS " speed=%u stop=%d flow=%s\n", t->c_ospeed, t->c_cflag & CSTOPB ? 2 : 1,
+           t->c_cflag & CRTSCTS ? "rtscts" : "none");
+}
+
+
+/* The application changed the settings of a --fake tty: tell the device
+ * endpoints on the control channel, as tty_fake does, if anything they care
+ * about changed */
+void fake_termios_changed(int slot) {
+  struct endpoint *e = tty[slot].fake;
+  struct termios2 t;
+  char line[TTYBUS_CTL_MAX];
+  struct chunk *ch;
+
+  if (ioctl(e->slave, TCGETS2, &t) < 0)
+    return;
+  if (!(t.c_lflag & EXTPROC)) {
+    // without it, the next changes would go unnoticed
+    t.c_lflag |= EXTPROC;
+    ioctl(e->slave, TCSETS2, &t);
+  }
+  termios_line(&t, line, sizeof(line));
+  if (strcmp(line, e->line_sent) == 0)
+    return;
+  strcpy(e->line_sent, line);
+  fprintf(stderr, "Line settings of %s changed: %s", e->path, line);
+  syslog(LOG_INFO, "Line settings of %s changed: %s", e->path, line);
+  ch = chunk_new(slot, line, strlen(line), strlen(line));
+  if (!ch)
+    return;
+  ch->ctl = 1;
+  ch->to_devices = 1;
+  chunk_deliver(ch);
+  chunk_put(ch);
+}
+
+
+/* A --fake pty master, in packet mode: each read starts with a status byte,
+ * followed by the data, or alone when there is news about the slave side. */
+int fake_read(struct tty_client *c, char *buffer) {
+  unsigned char status;
+  struct iovec iov[2];
+  int r;
+
+  iov[0].iov_base = &status;
+  iov[0].iov_len = 1;
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = BUFFER_SIZE;
+  while ((r = readv(c->fd, iov, 2)) > 0 && status != TIOCPKT_DATA) {
+    if (status & TIOCPKT_IOCTL)
+      fake_termios_changed(c - tty);
+  }
+  return r > 0 ? r - 1 : r;
+}
+
+
+int client_read(struct tty_client *c, char *buffer) {
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int passed_fd = -1;
+  char *end;
+  int r;
+
+  if (c->fake)
+    return fake_read(c, buffer);
+  if (!c->fresh)
+    return read(c->fd, buffer, BUFFER_SIZE);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buffer;
+  iov.iov_len = BUFFER_SIZE;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  r = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+  if (r <= 0)
+    return r;
+  c->fresh = 0;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (r < TTYBUS_HELLO_MAGIC_LEN || memcmp(buffer, TTYBUS_HELLO_MAGIC, TTYBUS_HELLO_MAGIC_LEN) != 0 ||
+      (end = memchr(buffer, '\n', r)) == NULL) {
+    if (passed_fd >= 0)
+      close(passed_fd);
+    return r;
+  }
+  *end++ = '\0';
+  client_hello(c, buffer + TTYBUS_HELLO_MAGIC_LEN, passed_fd);
+  r -= end - buffer;
+  if (r == 0)
+    return read(c->fd, buffer, BUFFER_SIZE);
+  memmove(buffer, end, r);
+  return r;
+}
+
+
+/* Packet clients: up to read_budget messages in one recvmmsg(), each one
+ * becoming a chunk. Returns the number of messages, 0 at end of file, or -1;
+ * *more is set if the socket may still have some. */
+int client_read_pkts(int slot, int *more) {
+  static char bufs[TTYBUS_PKT_BATCH][TTYBUS_PKT_MAX];
+  struct mmsghdr msgs[TTYBUS_PKT_BATCH];
+  struct iovec iov[TTYBUS_PKT_BATCH];
+  int i, n, vlen = read_budget < TTYBUS_PKT_BATCH ? read_budget : TTYBUS_PKT_BATCH;
+
+  // a blocking queue may only have room for one more chunk
+  if (buses[tty[slot].bus].nblocking > 0)
+    vlen = 1;
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * vlen);
+  for (i = 0; i < vlen; i++) {
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = TTYBUS_PKT_MAX;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg(tty[slot].fd, msgs, vlen, MSG_DONTWAIT, NULL);
+  counters.reads++;
+  *more = n == vlen;
+  for (i = 0; i < n; i++) {
+    // an empty message is how recvmmsg() reports the end of the stream
+    if (msgs[i].msg_len == 0)
+      return 0;
+    counters.chunks++;
+    counters.bytes += msgs[i].msg_len;
+    tty[slot].stats.chunks_in++;
+    tty[slot].stats.bytes_in += msgs[i].msg_len;
+    recvbuff(slot, bufs[i], msgs[i].msg_len);
+  }
+  return n;
+}
+
+
+/* One round-robin pass over the clients with pending input. A client that
+ * uses up its budget goes back to the tail of the queue; one that would
+ * block leaves it until epoll reports it readable again. */
+void service_ready(char *buffer) {
+  int pass = ready_count;
+  int slot, budget, more, r = 0;
+
+  while (pass-- > 0) {
+    slot = ready_pop();
+    if (tty[slot].closing || tty[slot].fd == -1)
+      continue;
+    if (buses[tty[slot].bus].stalled) {
+      tty[slot].stalled = 1;  // bus_resume() puts it back on the list
+      continue;
+    }
+    if (tty[slot].pkt && !tty[slot].fresh) {
+      r = client_read_pkts(slot, &more);
+      if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+        client_del(slot);
+      else if (r > 0 && more && buses[tty[slot].bus].stalled)
+        tty[slot].stalled = 1;
+      else if (r > 0 && more)
+        ready_push(slot);
+      continue;
+    }
+    for (budget = 0; budget < read_budget; budget++) {
+      r = client_read(&tty[slot], buffer);
+      counters.reads++;
+      if (r <= 0)
+        break;
+      counters.chunks++;
+      counters.bytes += r;
+      tty[slot].stats.chunks_in++;
+      tty[slot].stats.bytes_in += r;
+      recvbuff(slot, buffer, r);
+      if (buses[tty[slot].bus].stalled)
+        break;
+    }
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+      client_del(slot);
+    else if (r > 0 && buses[tty[slot].bus].stalled)
+      tty[slot].stalled = 1;
+    else if (r > 0)
+      ready_push(slot);
+  }
+}
+
+
+/* policy: for the clients of the bus, -1 for the default one */
+int bus_add(char *path, char *defname, int policy, char *transact) {
+  char *terms;
+  int b, fd;
+
+  for (b = 0; b < nbuses && buses[b].path; b++)
+    ;
+  if (b == MAX_BUSES) {
+    fprintf(stderr, "Too many buses, not creating %s\n", path);
+    syslog(LOG_WARNING, "Too many buses, not creating %s\n", path);
+    return -1;
+  }
+  fd = bus_init(path, bus_type);
+  if (fd < 0 || event_add(fd, BUS_SLOT | b, EPOLLIN) < 0) {
+    fprintf(stderr, "Cannot bind to %s: %s\n", path, strerror(errno));
+    syslog(LOG_ERR, "Cannot bind to %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      bus_destroy(fd, path);
+    return -1;
+  }
+  buses[b].listenfd = fd;
+  buses[b].pending = 0;
+  buses[b].chunks = 0;
+  buses[b].bytes = 0;
+  buses[b].seq = 0;
+  buses[b].cur_seq = 0;
+  buses[b].nfiltered = 0;
+  buses[b].nblocking = 0;
+  buses[b].stalled = 0;
+  buses[b].policy = policy < 0 ? default_policy : policy;
+  if (buses[b].policy == POLICY_BLOCK && nworkers > 0) {
+    fprintf(stderr, "Bus %s can't block with -t, dropping newest chunks instead\n", path);
+    syslog(LOG_WARNING, "Bus %s can't block with -t, dropping newest chunks instead\n", path);
+    buses[b].policy = POLICY_DROP_NEWEST;
+  }
+  if (!transact)
+    transact = default_transact;
+  buses[b].transact = transact != NULL;
+  buses[b].terms = NULL;
+  buses[b].owner = -1;
+  buses[b].txq_head = 0;
+  buses[b].txq_count = 0;
+  buses[b].transactions = 0;
+  buses[b].noreply = 0;
+  if (transact && txn_timerfd < 0) {
+    txn_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (txn_timerfd < 0 || event_add(txn_timerfd, TXN_SLOT, EPOLLIN) < 0) {
+      fprintf(stderr, "Cannot create transaction timer: %s\n", strerror(errno));
+      syslog(LOG_ERR, "Cannot create transaction timer: %s\n", strerror(errno));
+      if (txn_timerfd >= 0)
+        close(txn_timerfd);
+      txn_timerfd = -1;
+      bus_destroy(fd, path);
+      return -1;
+    }
+  }
+  if (transact && transact[0] && (terms = strdup(transact)) != NULL) {
+    buses[b].terms = calloc(1, sizeof(struct line_filter));
+    if (buses[b].terms)
+      patterns_parse(buses[b].terms, terms, 1);
+    free(terms);
+  }
+  memset(&buses[b].gone, 0, sizeof(buses[b].gone));
+  buses[b].ring.memfd = -1;
+  if (ring_size > 0 && ring_init(&buses[b].ring, ring_size) < 0) {
+    fprintf(stderr, "Cannot create shared ring: %s\n", strerror(errno));
+    syslog(LOG_ERR, "Cannot create shared ring: %s\n", strerror(errno));
+    bus_destroy(fd, path);
+    return -1;
+  }
+  buses[b].path = strdup(path);
+  buses[b].defname = defname ? strdup(defname) : NULL;
+  if (b == nbuses)
+    nbuses++;
+  fprintf(stderr, "Creating bus: %s\n", path);
+  syslog(LOG_INFO, "Creating bus: %s\n", path);
+  return b;
+}
+
+
+/* Disconnect every client of the bus and stop listening on it */
+void bus_remove(int b) {
+  struct bus *bus = &buses[b];
+
+  fprintf(stderr, "Removing bus: %s\n", bus->path);
+  syslog(LOG_INFO, "Removing bus: %s\n", bus->path);
+  while (bus->nmembers > 0)
+    client_del(bus->members[bus->nmembers - 1]);
+  while (bus->txq_count > 0) {
+    chunk_put(bus->txq[bus->txq_head]);
+    bus->txq_head = (bus->txq_head + 1) % TXN_QUEUE;
+    bus->txq_count--;
+  }
+  bus->owner = -1;
+  if (bus->terms)
+    patterns_free(bus->terms);
+  bus->terms = NULL;
+  ring_destroy(&bus->ring);
+  bus_destroy(bus->listenfd, bus->path);
+  bus->listenfd = -1;
+  free(bus->path);
+  free(bus->defname);
+  bus->path = NULL;
+  bus->defname = NULL;
+}
+
+
+/* Read the bus path out of a definition file: bus_dir/name, minus the .bus
+ * suffix, unless the file has a path=bus_path line. A policy= line sets the
+ * policy, a transact=terminators line makes it a transaction bus; *transact
+ * is then to be freed. */
+int bus_def_read(char *name, char *path, int len, int *policy, char **transact) {
+  char file[PATH_MAX], line[PATH_MAX];
+  FILE *f;
+
+  snprintf(file, sizeof(file), "%s/%s", bus_dir, name);
+  f = fopen(file, "r");
+  if (!f)
+    return -1;
+  snprintf(path, len, "%s/%.*s", bus_dir, (int) strlen(name) - 4, name);
+  *policy = -1;
+  *transact = NULL;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strncmp(line, "path=", 5) == 0)
+      snprintf(path, len, "%s", line + 5);
+    else if (strncmp(line, "policy=", 7) == 0)
+      *policy = policy_parse(line + 7);
+    else if (strncmp(line, "transact=", 9) == 0 && !*transact)
+      *transact = strdup(line + 9);
+  }
+  fclose(f);
+  return 0;
+}
+
+
+/* Bring the buses defined in bus_dir in line with the *.bus files it holds */
+void bus_dir_scan(void) {
+  char seen[MAX_BUSES];
+  char path[PATH_MAX];
+  struct dirent *de;
+  DIR *dir;
+  size_t len;
+  char *transact;
+  int b, policy;
+
+  dir = opendir(bus_dir);
+  if (!dir) {
+    fprintf(stderr, "Cannot read %s: %s\n", bus_dir, strerror(errno));
+    syslog(LOG_WARNING, "Cannot read %s: %s\n", bus_dir, strerror(errno));
+    return;
+  }
+  memset(seen, 0, sizeof(seen));
+  while ((de = readdir(dir)) != NULL) {
+    len = strlen(de->d_name);
+    if (len <= 4 || strcmp(de->d_name + len - 4, ".bus") != 0 ||
+        bus_def_read(de->d_name, path, sizeof(path), &policy, &transact) < 0)
+      continue;
+    for (b = 0; b < nbuses; b++) {
+      if (buses[b].path && strcmp(buses[b].path, path) == 0)
+        break;
+    }
+    if (b < nbuses) {
+      if (buses[b].defname && strcmp(buses[b].defname, de->d_name) == 0)
+        seen[b] = 1;
+      free(transact);
+      continue;  // already served: unchanged, or defined twice
+    }
+    b = bus_add(path, de->d_name, policy, transact);
+    free(transact);
+    if (b >= 0)
+      seen[b] = 1;
+  }
+  closedir(dir);
+  for (b = 0; b < nbuses; b++) {
+    if (buses[b].path && buses[b].defname && !seen[b])
+      bus_remove(b);
+  }
+}
+
+
+/* Raw mode, unless --cooked, and EXTPROC with the master in packet mode, as
+ * tty_fake sets its pty up: every change of the settings of the fake tty then
+ * shows up on the master. */
+int fake_setup(struct endpoint *e, int ptmx) {
+  struct termios2 t;
+  int one = 1;
+
+  if (ioctl(e->slave, TCGETS2, &t) < 0)
+    return -1;
+  if (!fake_cooked) {
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(CSIZE | PARENB);
+    t.c_cflag |= CS8;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+  }
+  t.c_lflag |= EXTPROC;
+  if (ioctl(e->slave, TCSETS2, &t) < 0 || ioctl(ptmx, TIOCPKT, &one) < 0)
+    return -1;
+  termios_line(&t, e->line_sent, sizeof(e->line_sent));
+  return 0;
+}
+
+
+/* Open the device, or create the fake tty, the way tty_attach and tty_fake
+ * do, and make it a member of bus b. */
+int endpoint_open(struct endpoint *e, int b) {
+  char *pts;
+  int fd, slot;
+
+  if (e->type == ENDPOINT_ATTACH) {
+    fd = open(e->path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+      fprintf(stderr, "Cannot open %s: %s\n", e->path, strerror(errno));
+      syslog(LOG_ERR, "Cannot open %s: %s\n", e->path, strerror(errno));
+      return -1;
+    }
+    fprintf(stderr, "Attaching %s to bus %s\n", e->path, buses[b].path);
+    syslog(LOG_INFO, "Attaching %s to bus %s\n", e->path, buses[b].path);
+  } else {
+    if (access(e->path, W_OK) == 0) {
+      if (!force_overwrite) {
+        fprintf(stderr, "%s already exists! use -o to force overwrite\n", e->path);
+        syslog(LOG_ERR, "%s already exists! use -o to force overwrite\n", e->path);
+        return -1;
+      }
+      e->bak = malloc(strlen(e->path) + 5);
+      sprintf(e->bak, "%s.bak", e->path);
+      unlink(e->bak);
+      link(e->path, e->bak);
+      unlink(e->path);
+    }
+    fd = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || (pts = ptsname(fd)) == NULL) {
+      fprintf(stderr, "Cannot create a pty for %s: %s\n", e->path, strerror(errno));
+      syslog(LOG_ERR, "Cannot create a pty for %s: %s\n", e->path, strerror(errno));
+      return -1;
+    }
+    // as in tty_fake, so the master doesn't hang up when users come and go
+    e->slave = open(pts, O_RDWR | O_NOCTTY);
+    if (e->slave < 0 || fake_setup(e, fd) < 0 || symlink(pts, e->path) < 0) {
+      fprintf(stderr, "Cannot create %s: %s\n", e->path, strerror(errno));
+      syslog(LOG_ERR, "Cannot create %s: %s\n", e->path, strerror(errno));
+      return -1;
+    }
+    chmod(pts, 00777);
+    fprintf(stderr, "Device: %s is now %s\n", pts, e->path);
+    syslog(LOG_INFO, "Device: %s is now %s\n", pts, e->path);
+  }
+  slot = client_add(fd, b);
+  if (slot < 0)
+    return -1;
+  tty[slot].fresh = 0;  // no hello on a tty
+  tty[slot].pkt = 0;
+  if (e->type == ENDPOINT_ATTACH)
+    tty[slot].role = ROLE_DEVICE;
+  else
+    tty[slot].fake = e;
+  // a tty can't be shut down like a socket
+  if (tty[slot].policy == POLICY_DISCONNECT)
+    tty[slot].policy = POLICY_DROP_NEWEST;
+  tty[slot].name = e->path;
+  return 0;
+}
+
+
+/* Write a JSON string, escaping what needs to be */
+void json_string(FILE *f, const char *str) {
+  fputc('"', f);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(f, "\\%c", *str);
+    else if ((unsigned char) *str < 0x20)
+      fprintf(f, "\\u%04x", *str);
+    else
+      fputc(*str, f);
+  }
+  fputc('"', f);
+}
+
+
+void stats_print(FILE *f, struct client_stats *st, int json) {
+  int b;
+
+  if (!json) {
+    fprintf(f,
+            "chunks_in %lu bytes_in %lu chunks_out %lu bytes_out %lu drops %lu drops_old %lu stalls %lu kicks %lu "
+            "latency_us",
+            st->chunks_in, st->bytes_in, st->chunks_out, st->bytes_out, st->drops, st->drops_old, st->stalls, st->kicks);
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      if (st->latency[b] == 0)
+        continue;
+      if (b < LAT_BUCKETS - 1)
+        fprintf(f, " <%lu:%lu", 1UL << b, st->latency[b]);
+      else
+        fprintf(f, " >=%lu:%lu", 1UL << (b - 1), st->latency[b]);
+    }
+    return;
+  }
+  fprintf(f,
+          "\"chunks_in\":%lu,\"bytes_in\":%lu,\"chunks_out\":%lu,\"bytes_out\":%lu,\"drops\":%lu,\"drops_old\":%lu,"
+          "\"stalls\":%lu,\"kicks\":%lu,\"latency\":[",
+          st->chunks_in, st->bytes_in, st->chunks_out, st->bytes_out, st->drops, st->drops_old, st->stalls, st->kicks);
+  for (b = 0; b < LAT_BUCKETS; b++)
+    fprintf(f, "%s%lu", b ? "," : "", st->latency[b]);
+  fputc(']', f);
+}
+
+
+/* Counters of every bus, with the totals including clients that already
+ * left, and of each of their clients. In JSON, latency[i] counts the chunks
+ * written less than 2^i us after they were read, the last one the rest. */
+void ctl_report(FILE *f, int json) {
+  struct client_stats total;
+  struct tty_client *c;
+  int b, m, first = 1;
+
+  if (json)
+    fprintf(f, "{\"clients\":%d,\"rejects\":%lu,\"buses\":[", nclients, counters.rejects);
+  else
+    fprintf(f, "clients %d rejects %lu\n", nclients, counters.rejects);
+  for (b = 0; b < nbuses; b++) {
+    if (!buses[b].path)
+      continue;
+    total = buses[b].gone;
+    for (m = 0; m < buses[b].nmembers; m++)
+      stats_add(&total, &tty[buses[b].members[m]].stats);
+    if (json) {
+      fprintf(f, "%s{\"path\":", first ? "" : ",");
+      json_string(f, buses[b].path);
+      fprintf(f, ",\"nclients\":%d,\"policy\":\"%s\",", buses[b].nmembers, policy_names[buses[b].policy]);
+      if (buses[b].transact)
+        fprintf(f, "\"transactions\":%lu,\"noreply\":%lu,\"pending\":%d,", buses[b].transactions, buses[b].noreply,
+                buses[b].txq_count);
+    } else {
+      fprintf(f, "bus %s clients %d policy %s ", buses[b].path, buses[b].nmembers, policy_names[buses[b].policy]);
+      if (buses[b].transact)
+        fprintf(f, "transactions %lu noreply %lu pending %d ", buses[b].transactions, buses[b].noreply,
+                buses[b].txq_count);
+    }
+    first = 0;
+    stats_print(f, &total, json);
+    fputs(json ? ",\"clients\":[" : "\n", f);
+    for (m = 0; m < buses[b].nmembers; m++) {
+      c = &tty[buses[b].members[m]];
+      if (json) {
+        fprintf(f, "%s{\"id\":%u,\"pid\":%d,\"name\":", m ? "," : "", c->id, (int) c->pid);
+        json_string(f, c->name ? c->name : "");
+        fprintf(f, ",\"role\":\"%s\",\"ctl\":%s", role_names[c->role], c->ctl ? "true" : "false");
+        fprintf(f, ",\"ring\":%s,\"policy\":\"%s\",\"queue\":%u,\"queue_len\":%u,", c->ring_slot >= 0 ? "true" : "false",
+                policy_names[c->policy], c->q.count, queue_len);
+        stats_print(f, &c->stats, json);
+        fputc('}', f);
+      } else {
+        fprintf(f, "  client %u pid %d%s%s role %s%s%s policy %s queue %u/%u ", c->id, (int) c->pid,
+                c->name ? " name " : "", c->name ? c->name : "", role_names[c->role], c->ctl ? " ctl" : "",
+                c->ring_slot >= 0 ? " ring" : "", policy_names[c->policy], c->q.count, queue_len);
+        stats_print(f, &c->stats, json);
+        fputc('\n', f);
+      }
+    }
+    if (json)
+      fputs("]}", f);
+  }
+  if (json)
+    fputs("]}\n", f);
+}
+
+
+void ctl_close(struct ctl_conn *cc) {
+  close(cc->fd);
+  free(cc->out);
+  cc->fd = -1;
+  cc->out = NULL;
+}
+
+
+void ctl_accept(void) {
+  int fd, i;
+
+  while ((fd = accept(ctl_fd, NULL, NULL)) >= 0) {
+    for (i = 0; i < MAX_CTL && ctl[i].fd >= 0; i++)
+      ;
+    if (i == MAX_CTL || event_add(fd, CTL_CONN | i, EPOLLIN | EPOLLOUT) < 0) {
+      close(fd);
+      continue;
+    }
+    ctl[i].fd = fd;
+    ctl[i].out = NULL;
+  }
+}
+
+
+/* Read the request, then send the reply as the socket takes it */
+void ctl_service(struct ctl_conn *cc) {
+  char req[64];
+  FILE *f;
+  int r;
+
+  if (!cc->out) {
+    r = read(cc->fd, req, sizeof(req) - 1);
+    if (r < 0 && errno == EAGAIN)
+      return;
+    if (r < 0) {
+      ctl_close(cc);
+      return;
+    }
+    req[r] = '\0';  // nothing at all asks for text too
+    f = open_memstream(&cc->out, &cc->len);
+    if (!f) {
+      ctl_close(cc);
+      return;
+    }
+    ctl_report(f, strncmp(req, "json", 4) == 0);
+    fclose(f);
+    cc->off = 0;
+  }
+  while (cc->off < cc->len) {
+    r = write(cc->fd, cc->out + cc->off, cc->len - cc->off);
+    if (r < 0 && errno == EAGAIN)
+      return;
+    if (r < 0)
+      break;
+    cc->off += r;
+  }
+  ctl_close(cc);
+}
+
+
+int main(int argc, char *argv[]) {
+  int n = 0;
+  int i, b;
+  int pending_accept, dir_changed;
+  struct epoll_event events[MAX_EVENTS];
+  struct rlimit nofile;
+  char buffer[BUFFER_SIZE];
+  char *paths[MAX_BUSES];
+  int pathbus[MAX_BUSES];
+  int pathpolicy[MAX_BUSES];
+  char *pathtransact[MAX_BUSES];
+  int npaths = 0;
+  char *end;
+  long len;
+  struct sigaction sa;
+  static struct option long_options[] = {
+      {"attach", required_argument, NULL, 'a'},
+      {"fake", required_argument, NULL, 'f'},
+      {"cooked", no_argument, NULL, 'O'},
+      {"capture", required_argument, NULL, 'R'},
+      {"capture-size", required_argument, NULL, 'Z'},
+      {"capture-files", required_argument, NULL, 'K'},
+      {"policy", required_argument, NULL, 'y'},
+      {"kick-after", required_argument, NULL, 'k'},
+      {"transact", optional_argument, NULL, 'X'},
+      {"reply-timeout", required_argument, NULL, 'T'},
+      {"reply-gap", required_argument, NULL, 'G'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int daemonize = 0;
+  int threads = 0;
+
+  while (1) {
+    int c;
+    c = getopt_long(argc, argv, "a:b:c:C:dD:f:hm:oPq:s:t:w:W:", long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'a':
+      case 'f':
+        if (nendpoints == MAX_ENDPOINTS)
+          usage(argv[0]);  // implies exit
+        endpoints[nendpoints].type = c == 'a' ? ENDPOINT_ATTACH : ENDPOINT_FAKE;
+        endpoints[nendpoints].path = strdup(optarg);
+        endpoints[nendpoints].bus = npaths > 0 ? npaths - 1 : 0;
+        endpoints[nendpoints].slave = -1;
+        nendpoints++;
+        break;
+      case 'b':
+        read_budget = atoi(optarg);
+        if (read_budget < 1)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'c':
+        max_clients = atoi(optarg);
+        if (max_clients < 1 || max_clients >= (int) EVENT_SLOT)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'C':
+        ctl_path = strdup(optarg);
+        break;
+      case 'd':
+        daemonize = 1;
+        break;
+      case 'D':
+        bus_dir = strdup(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);  // implies exit
+        break;
+      case 'm':
+        ring_size = strtoul(optarg, NULL, 0);
+        break;
+      case 'o':
+        force_overwrite = 1;
+        break;
+      case 'O':
+        fake_cooked = 1;
+        break;
+      case 'P':
+        bus_type = SOCK_SEQPACKET;
+        break;
+      case 'R':
+        if (ncaptures == MAX_BUSES)
+          usage(argv[0]);  // implies exit
+        capture_bus[ncaptures] = npaths > 0 ? npaths - 1 : 0;
+        captures[ncaptures++] = optarg;
+        break;
+      case 'Z':
+        cap_size = strtoul(optarg, NULL, 0);
+        if (cap_size < 2 * TTYBUS_CAP_HDR_SIZE + BUFFER_SIZE)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'y':
+        if ((i = policy_parse(optarg)) < 0)
+          usage(argv[0]);  // implies exit
+        if (npaths > 0)
+          pathpolicy[npaths - 1] = i;
+        else
+          default_policy = i;
+        break;
+      case 'k':
+        kick_after = atol(optarg);
+        if (kick_after < 1)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'X':
+        if (npaths > 0)
+          pathtransact[npaths - 1] = optarg ? optarg : "";
+        else
+          default_transact = optarg ? optarg : "";
+        break;
+      case 'T':
+        reply_timeout = atol(optarg);
+        if (reply_timeout < 1)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'G':
+        reply_gap = atol(optarg);
+        if (reply_gap < 1)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'K':
+        cap_files = atoi(optarg);
+        if (cap_files < 1)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'q':
+        len = strtol(optarg, &end, 10);
+        if (*end || len < 1 || len > QUEUE_MAX)
+          usage(argv[0]);  // implies exit
+        queue_len = len;
+        break;
+      case 's':
+        if (npaths == MAX_BUSES)
+          usage(argv[0]);  // implies exit
+        pathpolicy[npaths] = -1;
+        pathtransact[npaths] = NULL;
+        paths[npaths++] = optarg;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'w':
+        batch_window = atol(optarg);
+        break;
+      case 'W':
+        batch_threshold = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);  // implies exit
+    }
+  }
+  if (optind < argc || (threads > 0 && batch_window > 0))
+    usage(argv[0]);  // implies exit
+
+  if (daemonize)
+    daemon(0, 0);
+
+  if (npaths == 0 && (!bus_dir || nendpoints > 0 || ncaptures > 0)) {
+    pathpolicy[npaths] = -1;
+    pathtransact[npaths] = NULL;
+    paths[npaths++] = DEFAULT_BUS;
+  }
+
+  atexit(exiting);
+  sigset(SIGTERM, signaled);
+  sigset(SIGINT, signaled);
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_signaled;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // every client is an fd: allow as many as the hard limit permits
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+  // the table must be allocated at full size before the workers start
+  nworkers = threads;
+  if (tty_grow() < 0)
+    exit(4);
+  nworkers = 0;
+  if (threads > 0 && workers_start(threads) < 0) {
+    fprintf(stderr, "Cannot start worker threads: %s\n", strerror(errno));
+    syslog(LOG_ERR, "Cannot start worker threads: %s\n", strerror(errno));
+    exit(4);
+  }
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    fprintf(stderr, "Cannot create event set: %s\n", strerror(errno));
+    syslog(LOG_ERR, "Cannot create event set: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (batch_window > 0) {
+    batch_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (batch_timerfd < 0 || event_add(batch_timerfd, TIMER_SLOT, EPOLLIN) < 0) {
+      fprintf(stderr, "Cannot create batch timer: %s\n", strerror(errno));
+      syslog(LOG_ERR, "Cannot create batch timer: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+  for (i = 0; i < npaths; i++) {
+    pathbus[i] = bus_add(paths[i], NULL, pathpolicy[i], pathtransact[i]);
+    if (pathbus[i] < 0)
+      exit(1);
+  }
+  for (i = 0; i < ncaptures; i++) {
+    struct bus *bus = &buses[pathbus[capture_bus[i]]];
+    if (bus->cap) {
+      fprintf(stderr, "Bus %s is already captured\n", bus->path);
+      exit(1);
+    }
+    bus->cap = calloc(1, sizeof(struct capture));
+    bus->cap->path = captures[i];
+    if (capture_open(bus->cap, bus->path) < 0)
+      exit(1);
+  }
+  for (i = 0; i < nendpoints; i++) {
+    if (endpoint_open(&endpoints[i], pathbus[endpoints[i].bus]) < 0)
+      exit(3);
+  }
+  if (ctl_path) {
+    for (i = 0; i < MAX_CTL; i++)
+      ctl[i].fd = -1;
+    ctl_fd = bus_init(ctl_path, SOCK_STREAM);
+    if (ctl_fd < 0 || event_add(ctl_fd, CTL_SLOT, EPOLLIN) < 0)
+      exit(1);
+  }
+  if (bus_dir) {
+    dir_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dir_watch < 0 ||
+        inotify_add_watch(dir_watch, bus_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0 ||
+        event_add(dir_watch, DIR_SLOT, EPOLLIN) < 0) {
+      fprintf(stderr, "Cannot watch %s: %s\n", bus_dir, strerror(errno));
+      syslog(LOG_ERR, "Cannot watch %s: %s\n", bus_dir, strerror(errno));
+      exit(1);
+    }
+    bus_dir_scan();
+  }
+  for (;;) {
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats();
+    }
+    // don't sleep while some client still has input left over from the last pass
+    n = epoll_wait(epfd, events, MAX_EVENTS, ready_count ? 0 : POLL_R_TIMEOUT);
+    counters.wakeups++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Poll error: %s\n", strerror(errno));
+      syslog(LOG_WARNING, "Poll error: %s\n", strerror(errno));
+      sleep(1);
+      continue;
+    }
+    pending_accept = 0;
+    dir_changed = 0;
+    for (i = 0; i < n; i++) {
+      uint32_t slot = events[i].data.u32;
+      if (slot == DIR_SLOT) {
+        char ev[4096];
+        while (read(dir_watch, ev, sizeof(ev)) > 0)
+          ;
+        dir_changed = 1;
+        continue;
+      }
+      if (slot == CTL_SLOT) {
+        ctl_accept();
+        continue;
+      }
+      if (slot == TXN_SLOT) {
+        uint64_t expired;
+        if (read(txn_timerfd, &expired, sizeof(expired)) > 0)
+          txn_expire();
+        continue;
+      }
+      if (slot & BUS_SLOT) {
+        buses[slot & ~BUS_SLOT].pending = 1;
+        pending_accept = 1;
+        continue;
+      }
+      if (slot & CTL_CONN) {
+        ctl_service(&ctl[slot & ~CTL_CONN]);
+        continue;
+      }
+      if (slot == TIMER_SLOT) {
+        uint64_t expired;
+        if (read(batch_timerfd, &expired, sizeof(expired)) > 0 && batch_armed)
+          batch_flush();
+        continue;
+      }
+      if (slot & EVENT_SLOT)
+        continue;  // never a client slot
+      if (tty[slot].closing || tty[slot].fd == -1)
+        continue;  // closed earlier in this batch
+      if ((events[i].events & EPOLLOUT) && tty[slot].blocked && client_flush(&tty[slot]) < 0) {
+        client_del(slot);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // edge-triggered: stays queued until a read would block
+        if (!tty[slot].ready)
+          ready_push(slot);
+      }
+    }
+    service_ready(buffer);
+    if (nworkers > 0)
+      shard_reclaim();
+
+    /* Accept, and add or remove buses, after the batch, so a slot freed
+     * above is not reused while stale events for it may still be pending in
+     * this batch. */
+    if (dir_changed)
+      bus_dir_scan();
+    for (b = 0; pending_accept && b < nbuses; b++) {
+      while (buses[b].pending) {
+        struct sockaddr_un cliaddr;
+        socklen_t len = sizeof(struct sockaddr_un);
+        int connfd;
+        if (!buses[b].path)
+          break;  // removed by the scan above
+        connfd = accept(buses[b].listenfd, (struct sockaddr *) &cliaddr, &len);
+        if (connfd >= 0) {
+          client_add(connfd, b);
+          continue;
+        }
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+          bus_destroy(buses[b].listenfd, buses[b].path);
+          buses[b].listenfd = bus_init(buses[b].path, bus_type);
+          event_add(buses[b].listenfd, BUS_SLOT | b, EPOLLIN);
+        }
+        buses[b].pending = 0;
+      }
+    }
+  }
+}
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <asm/termbits.h>  // termios2, as tty_attach: not with <termios.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -8,38 +9,70 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "configure.h"
+#include "ttybus.h"
 
 #define MAX_TTY        256
 #define BUFFER_SIZE    4096
-#define POLL_R_TIMEOUT 100
-#define POLL_W_TIMEOUT 50
-#define POLL_INTERVAL  10000000
+#define QUEUE_SIZE     65536
 
 static char *ttyfake;
 static char *tty_bus_path;
 static char *ttybak;
 static int force_overwrite = 0;
 static int restore = 0;
+static int use_ring = 0;
+static char filter[TTYBUS_HELLO_MAX];  // hello options subscribing to some lines only
+static char *role;
+static struct ttybus_ring ring;
+
+/* Data read from one side and not yet taken by the other one. A side is only
+ * read while its queue has room, so a slow reader holds the writer back
+ * instead of losing data. */
+struct fwd_queue {
+  char buf[QUEUE_SIZE];
+  int off;
+  int len;
+};
+
+static struct fwd_queue to_bus, to_pty;
+static int bus_pkt = 0;  // packet bus (tty_bus -P)
+
+/* Line settings: the application changing those of the fake tty is told to
+ * the real device on the control channel of the bus (see ttybus.h). */
+static int cooked = 0;  // -C: leave the pty in its default mode instead of raw
+static int ctlfd = -1;
+static char line_sent[TTYBUS_CTL_MAX];
 
 
 static void usage(char *app) {
   fprintf(stderr, "%s, Ver %s.%s.%s\n", basename(app), MAJORV, MINORV, SVNVERSION);
-  fprintf(stderr, "Usage: %s [-h] [-s bus_path] tty_device\n", app);
+  fprintf(stderr, "Usage: %s [-h] [-s bus_path] [-p prefix[,prefix...]] [-x pattern[,pattern...]] [-r role] [-C] tty_device\n", app);
   fprintf(stderr, "-h: shows this help\n");
   fprintf(stderr, "-d: detach from terminal and run as daemon\n");
   fprintf(stderr, "-s bus_path: uses bus_path as bus path name (default: /tmp/ttybus)\n");
-  fprintf(stderr, "-o: temporarly backup tty_device to tty_device.bak, if it exists, and restore the original file at exit\n\n");
+  fprintf(stderr, "-o: temporarly backup tty_device to tty_device.bak, if it exists, and restore the original file at exit\n");
+  fprintf(stderr, "-m: read bus data from the bus shared-memory ring (tty_bus -m) instead of the socket\n");
+  fprintf(stderr, "-p prefixes: only get the bus lines starting with one of these comma separated prefixes\n");
+  fprintf(stderr, "-x patterns: only get the bus lines containing one of these comma separated patterns\n");
+  fprintf(stderr, "   with -p and -x, %%XX stands for the byte of hex value XX, e.g. %%2C for a comma\n");
+  fprintf(stderr, "-r role: both (default), listen (what the device sends is dropped), talk (it gets nothing)\n");
+  fprintf(stderr, "   or star (it only talks to the real devices, tty_attach)\n");
+  fprintf(stderr, "-C: leave the fake device in its default (canonical, echoing) mode instead of raw mode\n");
+  fprintf(stderr, "The line settings the application sets on the fake device (speed, stop bits, flow control; ptys\n");
+  fprintf(stderr, "don't keep bits and parity) are passed on to tty_attach, which applies them to the real device\n\n");
   fprintf(stderr, "Please also see: tty_bus, tty_attach, tty_plug, dpipe\n");
   fprintf(stderr, "Example of usage:\n");
   fprintf(stderr, "  Create a new bus called /tmp/ttyS0mux\n");
@@ -49,17 +82,15 @@ static void usage(char *app) {
   fprintf(stderr, "  Create two fake ttyS0 devices, attached to the bus /tmp/ttyS0mux\n");
   fprintf(stderr, "    tty_fake -d -s /tmp/ttyS0mux /dev/ttyS0.0\n");
   fprintf(stderr, "    tty_fake -d -s /tmp/ttyS0mux /dev/ttyS0.1\n");
+  fprintf(stderr, "  Create a fake GPS device only showing position and fix sentences\n");
+  fprintf(stderr, "    tty_fake -d -s /tmp/gpsmux -p '$GPRMC,$GPGGA' /dev/gps.nav\n");
   exit(2);
 }
 
 
 int tty_connect(char *path) {
-  struct sockaddr_un sun;
-  int connect_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-  memset(&sun, 0, sizeof(struct sockaddr_un));
-  sun.sun_family = AF_UNIX;
-  strncpy(sun.sun_path, path, strlen(path));
-  if (connect(connect_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+  int connect_fd = ttybus_connect(path, &bus_pkt);
+  if (connect_fd < 0) {
     perror("Cannot connect to socket");
     syslog(LOG_ERR, "Cannot connect to socket\n");
     exit(-1);
@@ -84,26 +115,166 @@ static void tty_restore(int __attribute__((unused)) signo) {
   exit(0);
 }
 
+
+static int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/* Free space at the end of the queue, moving the pending data to the front
+ * when that makes room */
+static int queue_room(struct fwd_queue *q) {
+  if (q->off > 0 && q->off + q->len + BUFFER_SIZE > QUEUE_SIZE) {
+    memmove(q->buf, q->buf + q->off, q->len);
+    q->off = 0;
+  }
+  return QUEUE_SIZE - q->off - q->len;
+}
+
+
+/* Describe the line settings in a control channel line */
+static void termios_line(struct termios2 *t, char *line, int len) {
+  snprintf(line, len, TTYBUS_CTL_TERMIOS " speed=%u stop=%d flow=%s\n", t->c_ospeed, t->c_cflag & CSTOPB ? 2 : 1,
+           t->c_cflag & CRTSCTS ? "rtscts" : "none");
+}
+
+
+/* Raw mode, unless -C, and EXTPROC: with the master in packet mode, every
+ * change of the settings of the fake tty then shows up there. */
+static int pty_setup(int ptmx, int slave) {
+  struct termios2 t;
+  int one = 1;
+
+  if (ioctl(slave, TCGETS2, &t) < 0)
+    return -1;
+  if (!cooked) {
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(CSIZE | PARENB);
+    t.c_cflag |= CS8;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+  }
+  t.c_lflag |= EXTPROC;
+  if (ioctl(slave, TCSETS2, &t) < 0 || ioctl(ptmx, TIOCPKT, &one) < 0)
+    return -1;
+  termios_line(&t, line_sent, sizeof(line_sent));
+  return 0;
+}
+
+
+/* The application changed the settings of the fake tty: tell the real device,
+ * if anything it cares about changed */
+static void termios_changed(int slave) {
+  struct termios2 t;
+  char line[TTYBUS_CTL_MAX];
+
+  if (ioctl(slave, TCGETS2, &t) < 0)
+    return;
+  if (!(t.c_lflag & EXTPROC)) {
+    // without it, the next changes would go unnoticed
+    t.c_lflag |= EXTPROC;
+    ioctl(slave, TCSETS2, &t);
+  }
+  termios_line(&t, line, sizeof(line));
+  if (strcmp(line, line_sent) == 0)
+    return;
+  strcpy(line_sent, line);
+  fprintf(stderr, "Line settings changed: %s", line);
+  syslog(LOG_INFO, "Line settings changed: %s", line);
+  if (ctlfd >= 0 && write(ctlfd, line, strlen(line)) < 0) {
+    fprintf(stderr, "Cannot send line settings to the bus: %s\n", strerror(errno));
+    syslog(LOG_WARNING, "Cannot send line settings to the bus: %s\n", strerror(errno));
+  }
+}
+
+
+/* Read from the master in packet mode: each read starts with a status byte,
+ * followed by the data, or alone when there is news about the slave side. */
+static int pty_fill(int ptmx, struct fwd_queue *q, int slave) {
+  unsigned char status;
+  struct iovec iov[2];
+  int room = queue_room(q);
+  int r;
+
+  iov[0].iov_base = &status;
+  iov[0].iov_len = 1;
+  iov[1].iov_base = q->buf + q->off + q->len;
+  iov[1].iov_len = room;
+  r = readv(ptmx, iov, 2);
+  if (r < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  if (r == 0)
+    return -1;
+  if (status != TIOCPKT_DATA) {
+    if (status & TIOCPKT_IOCTL)
+      termios_changed(slave);
+    return 0;
+  }
+  q->len += r - 1;
+  return 0;
+}
+
+
+/* Read what is available from fd, a packet bus if pkt is set. Returns -1 on
+ * error or end of file. */
+static int queue_fill(int fd, struct fwd_queue *q, int pkt) {
+  int r;
+
+  if (pkt)
+    r = ttybus_pkt_recv(fd, q->buf + q->off + q->len, queue_room(q));
+  else
+    r = read(fd, q->buf + q->off + q->len, queue_room(q));
+  if (r < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  if (r == 0)
+    return -1;
+  q->len += r;
+  return 0;
+}
+
+
+/* Write as much as fd takes without blocking, keeping the rest for later.
+ * To a packet bus, each write of at most TTYBUS_PKT_MAX bytes is a message. */
+static int queue_flush(int fd, struct fwd_queue *q, int pkt) {
+  int w;
+
+  while (q->len > 0) {
+    w = write(fd, q->buf + q->off, pkt && q->len > TTYBUS_PKT_MAX ? TTYBUS_PKT_MAX : q->len);
+    if (w < 0)
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    q->off += w;
+    q->len -= w;
+  }
+  q->off = 0;
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   int fd; 
-  struct pollfd pfd[2];
+  struct pollfd pfd[3];
+  char hello[TTYBUS_HELLO_MAX];
   int pollret, r;
-  char buffer[BUFFER_SIZE];
   char *pts;
-  int ptmx;
+  int ptmx, slave;
   int daemonize = 0;
-  struct timespec poll_interval, remaining;
-  poll_interval.tv_sec = 0;
-  poll_interval.tv_nsec = POLL_INTERVAL;
 
   while (1) {
     int c;
-    c = getopt(argc, argv, "dhos:");
+    c = getopt(argc, argv, "Cdhmop:r:s:x:");
     if (c == -1)
       break;
 
     switch (c) {
+      case 'C':
+        cooked = 1;
+        break;
+
       case 'd':
         daemonize = 1;
         break;
@@ -112,6 +283,14 @@ int main(int argc, char *argv[])
         usage(argv[0]); // implies exit
         break;
 
+      case 'm':
+        use_ring = 1;
+        break;
+
+      case 'r':
+        role = strdup(optarg);
+        break;
+
       case 's':
         tty_bus_path = strdup(optarg);
         break;
@@ -120,6 +299,12 @@ int main(int argc, char *argv[])
         force_overwrite = 1;
         break;
 
+      case 'p':
+      case 'x':
+        snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter), "%s%s=%s", filter[0] ? " " : "",
+                 c == 'p' ? "prefix" : "match", optarg);
+        break;
+
       default:
         usage(argv[0]); // implies exit
     }
@@ -154,7 +339,31 @@ int main(int argc, char *argv[])
   fprintf(stderr, "Connecting to bus: %s\n", tty_bus_path);
   syslog(LOG_INFO, "Connecting to bus: %s\n", tty_bus_path);
   fd = tty_connect(tty_bus_path);
+  // the ring carries everything: filtering is only done on the socket
+  if (filter[0])
+    use_ring = 0;
+  snprintf(hello, sizeof(hello), "%s%s%s%s", role ? "role=" : "", role ? role : "", role && filter[0] ? " " : "",
+           filter);
+  if (!use_ring && hello[0] && ttybus_hello(fd, hello, -1, NULL, 0, NULL) < 0) {
+    fprintf(stderr, "Cannot subscribe to %s\n", hello);
+    syslog(LOG_ERR, "Cannot subscribe to %s\n", hello);
+    exit(1);
+  }
+  if (use_ring && ttybus_ring_attach(fd, hello, &ring) < 0) {
+    fprintf(stderr, "No shared ring on bus %s, reading from the socket\n", tty_bus_path);
+    syslog(LOG_WARNING, "No shared ring on bus %s, reading from the socket\n", tty_bus_path);
+    use_ring = 0;
+  }
 
+  // a connection of its own, so line settings never wait behind data
+  ctlfd = ttybus_connect(tty_bus_path, &r);
+  if (ctlfd < 0 || ttybus_hello(ctlfd, "ctl role=star", -1, NULL, 0, NULL) < 0) {
+    fprintf(stderr, "No control channel on bus %s: line settings stay local\n", tty_bus_path);
+    syslog(LOG_WARNING, "No control channel on bus %s: line settings stay local\n", tty_bus_path);
+    if (ctlfd >= 0)
+      close(ctlfd);
+    ctlfd = -1;
+  }
 
   ptmx = open("/dev/ptmx", O_RDWR);
   pts = (char *) ptsname(ptmx);
@@ -162,6 +371,14 @@ int main(int argc, char *argv[])
   syslog(LOG_INFO, "Device: %s is now %s\n", pts, ttyfake);
   grantpt(ptmx);
   unlockpt(ptmx);
+  // hold the slave side too: once the last user of the fake device closed it,
+  // the master would otherwise report a hangup on every poll()
+  slave = open(pts, O_RDWR | O_NOCTTY);
+  if (slave < 0 || pty_setup(ptmx, slave) < 0 || set_nonblock(ptmx) < 0 || set_nonblock(fd) < 0) {
+    fprintf(stderr, "Cannot set up %s: %s\n", pts, strerror(errno));
+    syslog(LOG_ERR, "Cannot set up %s: %s\n", pts, strerror(errno));
+    exit(1);
+  }
 
   symlink(pts, ttyfake);
   chmod(pts, 00777);
@@ -172,52 +389,48 @@ int main(int argc, char *argv[])
   sigset(SIGUSR2, tty_restore);
 
   for (;;) {
-    nanosleep(&poll_interval, &remaining);
+    if (use_ring) {
+      while (queue_room(&to_pty) >= TTYBUS_RING_MAXREC &&
+             (r = ttybus_ring_read(&ring, to_pty.buf + to_pty.off + to_pty.len, TTYBUS_RING_MAXREC)) > 0)
+        to_pty.len += r;
+      if (queue_flush(ptmx, &to_pty, 0) < 0)
+        break;
+      // with the queue full, wait for the pty to drain instead
+      if (queue_room(&to_pty) >= TTYBUS_RING_MAXREC && ttybus_ring_arm(&ring))
+        continue;
+      pfd[2].fd = ring.efd;
+      pfd[2].events = POLLIN;
+    }
     pfd[0].fd = ptmx;
-    pfd[0].events = POLLIN;
+    pfd[0].events = (queue_room(&to_bus) > 0 ? POLLIN : 0) | (to_pty.len > 0 ? POLLOUT : 0);
     pfd[1].fd = fd;
-    pfd[1].events = POLLIN;
-    pollret = poll(pfd, 2, 1000);
+    pfd[1].events = (queue_room(&to_pty) >= (bus_pkt ? TTYBUS_PKT_MAX : 1) ? POLLIN : 0) | (to_bus.len > 0 ? POLLOUT : 0);
+    pollret = poll(pfd, use_ring ? 3 : 2, -1);
     if (pollret < 0) {
+      if (errno == EINTR)
+        continue;
       fprintf(stderr, "Poll error: %s\n", strerror(errno));
       syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
       exit(1);
     }
-    if (pollret == 0) {
-      continue;
-    }
 
     if ((pfd[0].revents & POLLERR || pfd[0].revents & POLLNVAL) ||
         (pfd[1].revents & POLLHUP || pfd[1].revents & POLLERR || pfd[1].revents & POLLNVAL)) {
       syslog(LOG_INFO, "Terminating: %d %d\n", pfd[0].revents, pfd[1].revents);
       exit(1);
     }
-    if (pfd[0].revents & POLLIN) {
-      r = read(ptmx, buffer, BUFFER_SIZE);
-      pfd[1].events = POLLOUT;
-      pollret = poll(&pfd[1], 1, 50);
-      if (pollret < 0) {
-        fprintf(stderr, "Poll error: %s\n", strerror(errno));
-        syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
-        exit(1);
-      }
-      if (pfd[1].revents & POLLOUT) {
-        write(fd, buffer, r);
-      }
-    }
-    if (pfd[1].revents & POLLIN) {
-      r = read(fd, buffer, BUFFER_SIZE);
-      pfd[0].fd = ptmx;
-      pfd[0].events = POLLOUT;
-      pollret = poll(&pfd[0], 1, 50);
-      if (pollret < 0) {
-        fprintf(stderr, "Poll error: %s\n", strerror(errno));
-        syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
-        exit(1);
-      }
-      if (pfd[0].revents & POLLOUT) {
-        write(ptmx, buffer, r);
-      }
-    }
+    if (use_ring && (pfd[2].revents & POLLIN))
+      ttybus_ring_ack(&ring);
+    if ((pfd[0].revents & POLLIN) && pty_fill(ptmx, &to_bus, slave) < 0)
+      break;
+    if ((pfd[1].revents & POLLIN) && queue_fill(fd, &to_pty, bus_pkt) < 0)
+      break;
+    // try right away: most of the time the other side takes it all
+    if (queue_flush(fd, &to_bus, bus_pkt) < 0 || queue_flush(ptmx, &to_pty, 0) < 0)
+      break;
   }
+  fprintf(stderr, "Terminating: connection closed\n");
+  syslog(LOG_INFO, "Terminating: connection closed\n");
+  close(slave);
+  exit(1);
 }
@@ -2,10 +2,14 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
@@ -15,25 +19,83 @@
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "configure.h"
+#include "ttybus.h"
 
 #define MAX_TTY        256
 #define BUFFER_SIZE    4096
 #define POLL_R_TIMEOUT 100
 #define POLL_W_TIMEOUT 50
 
+#define MAX_BUS_PATHS   16
+#define HANDSHAKE_WAIT  500  // msecs a connecting peer has to send its hello
+#define REPLY_WAIT      30000  // msecs the listener has to answer a compress request
+#define RECONNECT_MIN   1    // secs, doubling up to RECONNECT_MAX
+#define RECONNECT_MAX   30
+#define KEEPALIVE_IDLE  10   // secs
+#define KEEPALIVE_INTVL 5
+#define KEEPALIVE_CNT   3
+#define FLUSH_DELAY     10   // msecs compressed data may wait for more before it goes (-Z)
+
+/* Per session, printed at its end and on SIGUSR1. The wire counts are what went
+ * over the link to and from the peer, compressed or not. */
+struct plug_stats {
+  unsigned long bus_in, wire_in;
+  unsigned long bus_out, wire_out;
+  unsigned long flushes;
+  uint64_t zip_ns, unzip_ns;      // CPU time in deflate() and inflate()
+  uint64_t hold_ns, hold_max_ns;  // how long bus data waited in the compressor
+};
+
 static char *tty_bus_path;
+static char *bus_paths[MAX_BUS_PATHS];  // the buses a peer may name (-s)
+static int nbus_paths = 0;
+static char *listen_addr;
+static char *connect_addr;
+static char *remote_bus;
 static char *init_string;
+static int use_ring = 0;
+static int ring_on = 0;  // this session reads from the ring
+static char role[TTYBUS_HELLO_MAX];  // "role=..." hello option, if any
+static struct ttybus_ring ring;
+static struct ttybus_splice up, down;
+static int bus_pkt = 0;  // packet bus (tty_bus -P)
+static char pkt_buffer[TTYBUS_PKT_MAX * TTYBUS_PKT_BATCH];
+static int zip_level = 0;  // -z: compress the link, if the peer agrees
+static int flush_delay = FLUSH_DELAY;
+static int zip_on = 0;  // this session is compressed
+static z_stream zout, zin;
+static uint64_t hold_since;  // when the oldest data not flushed to the peer yet came, 0 if none
+static int hold_bytes;
+static char zip_error[128];  // why the peer's compressed stream was refused
+static struct plug_stats stats;
+static volatile sig_atomic_t stats_requested = 0;
 
 
 static void usage(char *app) {
   fprintf(stderr, "%s, Ver %s.%s.%s\n", basename(app), MAJORV, MINORV, SVNVERSION);
-  fprintf(stderr, "Usage: %s [-h] [-s bus_path]\n", app);
+  fprintf(stderr, "Usage: %s [-h] [-s bus_path] [-r role] [-l [host:]port | -c host:port [-n remote_bus]]\n", app);
+  fprintf(stderr, "          [-z level [-Z msecs]]\n");
   fprintf(stderr, "-h: shows this help\n");
   fprintf(stderr, "-d: detach from terminal and run as daemon\n");
   fprintf(stderr, "-s bus_path: uses bus_path as bus path name (default: /tmp/ttybus)\n");
-  fprintf(stderr, "-i init_string: send init string to plug's STDOUT\n\n");
+  fprintf(stderr, "   With -l, may be repeated: a peer may name any of them, the last one is the default\n");
+  fprintf(stderr, "-i init_string: send init string to plug's STDOUT (to the peer with -l or -c)\n");
+  fprintf(stderr, "-m: read bus data from the bus shared-memory ring (tty_bus -m) instead of the socket\n");
+  fprintf(stderr, "-r role: both (default), listen (a read-only tap: STDIN is dropped), talk (nothing\n");
+  fprintf(stderr, "   comes out on STDOUT) or star (STDIN only goes to the real devices, tty_attach)\n");
+  fprintf(stderr, "-l [host:]port: instead of STDIN/STDOUT, bridge the bus to a TCP peer connecting\n");
+  fprintf(stderr, "   on port, one at a time\n");
+  fprintf(stderr, "-c host:port: instead of STDIN/STDOUT, bridge the bus to a tty_plug -l on host,\n");
+  fprintf(stderr, "   connecting again whenever the connection is lost\n");
+  fprintf(stderr, "-n remote_bus: with -c, ask the remote tty_plug for one of its -s buses\n");
+  fprintf(stderr, "-z level: with -l or -c, compress the link with deflate at this level (1-9), if the\n");
+  fprintf(stderr, "   tty_plug on the other side was started with -z as well\n");
+  fprintf(stderr, "-Z msecs: with -z, longest time bus data may wait for more to compress with it\n");
+  fprintf(stderr, "   (default: %d, 0 sends each chunk right away)\n", FLUSH_DELAY);
+  fprintf(stderr, "Send SIGUSR1 to print the byte counters, compression ratio and cost of the session\n\n");
   fprintf(stderr, "Please also see: tty_bus, tty_attach, tty_fake, dpipe\n");
   fprintf(stderr, "Example of usage:\n");
   fprintf(stderr, "  Create two tty_bus, one per machine\n");
@@ -46,117 +108,624 @@ static void usage(char *app) {
   fprintf(stderr, "    venus:$ tty_fake -d -s /tmp/remote_ttybus -o /dev/ttyUSB0\n");
   fprintf(stderr, "  Connect the two buses on the two hosts, using remote ssh command and tty_plug\n");
   fprintf(stderr, "    venus:$ dpipe tty_plug -s /tmp/remote_ttybus = ssh mars tty_plug -s /tmp/exported_ttybus\n");
+  fprintf(stderr, "  or, on a trusted network, over TCP straight away\n");
+  fprintf(stderr, "    mars:$ tty_plug -d -s /tmp/exported_ttybus -l 5400\n");
+  fprintf(stderr, "    venus:$ tty_plug -d -s /tmp/remote_ttybus -c mars:5400 -n /tmp/exported_ttybus\n");
   exit(2);
 }
 
 
-int tty_connect(char *path) {
-  struct sockaddr_un sun;
-  int connect_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-  memset(&sun, 0, sizeof(struct sockaddr_un));
-  sun.sun_family = AF_UNIX;
-  strncpy(sun.sun_path, path, strlen(path));
-  if (connect(connect_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void stats_signaled(int signo) {
+  stats_requested = 1;
+}
+
+
+static void print_stats(void) {
+  char line[512];
+
+  snprintf(line, sizeof(line), "to_peer bytes %lu wire %lu ratio %.2f from_peer bytes %lu wire %lu ratio %.2f "
+           "deflate_ns/byte %.1f inflate_ns/byte %.1f flushes %lu hold_avg_ms %.3f hold_max_ms %.3f\n",
+           stats.bus_out, stats.wire_out, stats.wire_out ? (double) stats.bus_out / stats.wire_out : 0.0,
+           stats.bus_in, stats.wire_in, stats.wire_in ? (double) stats.bus_in / stats.wire_in : 0.0,
+           stats.bus_out ? (double) stats.zip_ns / stats.bus_out : 0.0,
+           stats.bus_in ? (double) stats.unzip_ns / stats.bus_in : 0.0, stats.flushes,
+           stats.flushes ? stats.hold_ns / 1e6 / stats.flushes : 0.0, stats.hold_max_ns / 1e6);
+  fprintf(stderr, "%s", line);
+  syslog(LOG_INFO, "%s", line);
+}
+
+
+/* Connect to the bus, with the shared ring and role asked for. Returns the
+ * bus fd, or -1. */
+static int bus_open(char *path) {
+  int fd;
+
+  fprintf(stderr, "Connecting to bus: %s\n", path);
+  syslog(LOG_INFO, "Connecting to bus: %s\n", path);
+  fd = ttybus_connect(path, &bus_pkt);
+  if (fd < 0) {
     perror("Cannot connect to socket");
     syslog(LOG_ERR, "Cannot connect to socket\n");
-    exit(-1);
+    return -1;
+  }
+  ring_on = use_ring;
+  if (ring_on && ttybus_ring_attach(fd, role, &ring) < 0) {
+    fprintf(stderr, "No shared ring on bus %s, reading from the socket\n", path);
+    syslog(LOG_WARNING, "No shared ring on bus %s, reading from the socket\n", path);
+    ring_on = 0;
+  } else if (!ring_on && role[0] && ttybus_hello(fd, role, -1, NULL, 0, NULL) < 0) {
+    fprintf(stderr, "Cannot send %s to bus %s\n", role, path);
+    syslog(LOG_ERR, "Cannot send %s to bus %s\n", role, path);
+    close(fd);
+    return -1;
   }
-  return connect_fd;
+  return fd;
 }
 
 
-int main(int argc, char *argv[]) {
-  int fd;
-  struct pollfd pfd[2];
-  int pollret, r;
+static void bus_close(int fd) {
+  if (ring_on)
+    ttybus_ring_detach(&ring);
+  close(fd);
+}
+
+
+/* Split [host:]port, host possibly in brackets for IPv6, and resolve it */
+static struct addrinfo *tcp_resolve(char *addr, int passive) {
+  struct addrinfo hints, *res;
+  char host[256], *port;
+  int err;
+
+  snprintf(host, sizeof(host), "%s", addr);
+  port = strrchr(host, ':');
+  if (port)
+    *port++ = '\0';
+  else
+    port = host;
+  if (host[0] == '[' && port > host && port[-2] == ']') {
+    port[-2] = '\0';
+    memmove(host, host + 1, strlen(host));
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  err = getaddrinfo(port == host || !host[0] ? NULL : host, port, &hints, &res);
+  if (err) {
+    fprintf(stderr, "Cannot resolve %s: %s\n", addr, gai_strerror(err));
+    syslog(LOG_ERR, "Cannot resolve %s: %s\n", addr, gai_strerror(err));
+    return NULL;
+  }
+  return res;
+}
+
+
+static int tcp_listen(char *addr) {
+  struct addrinfo *res, *ai;
+  int fd = -1, one = 1;
+
+  res = tcp_resolve(addr, 1);
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 4) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", addr, strerror(errno));
+    syslog(LOG_ERR, "Cannot listen on %s: %s\n", addr, strerror(errno));
+  }
+  if (res)
+    freeaddrinfo(res);
+  return fd;
+}
+
+
+static int tcp_connect(char *addr) {
+  struct addrinfo *res, *ai;
+  int fd = -1;
+
+  res = tcp_resolve(addr, 0);
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Cannot connect to %s: %s\n", addr, strerror(errno));
+    syslog(LOG_WARNING, "Cannot connect to %s: %s\n", addr, strerror(errno));
+  }
+  if (res)
+    freeaddrinfo(res);
+  return fd;
+}
+
+
+/* Bus traffic is small writes that should go out right away, and a peer that
+ * silently went away should be noticed within half a minute */
+static void tcp_tune(int fd) {
+  int one = 1, idle = KEEPALIVE_IDLE, intvl = KEEPALIVE_INTVL, cnt = KEEPALIVE_CNT;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+}
+
+
+/* Wait up to wait msecs for the first bytes from the peer: if they are a
+ * hello line, take it out of the stream and copy its options to line. Anything
+ * else is data, and left where it is. Returns 1 on a hello, 0 if there was
+ * none, -1 if it was too long. */
+static int hello_peek(int sock, char *line, int len, int wait) {
+  char buf[TTYBUS_HELLO_MAX], *nl;
+  struct pollfd pfd;
+  uint64_t deadline = now_ns() + wait * 1000000ULL, now;
+  int r, want = 1, ret = 0;
+
+  pfd.fd = sock;
+  pfd.events = POLLIN | POLLRDHUP;
+  while ((now = now_ns()) < deadline) {
+    // only wake up once there is more than what was looked at already
+    setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, &want, sizeof(want));
+    r = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    r = recv(sock, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r <= 0)
+      break;  // the session finds out soon enough
+    if (memcmp(buf, TTYBUS_HELLO_MAGIC, r < TTYBUS_HELLO_MAGIC_LEN ? r : TTYBUS_HELLO_MAGIC_LEN) != 0)
+      break;  // plain data
+    if (r > TTYBUS_HELLO_MAGIC_LEN && (nl = memchr(buf, '\n', r)) != NULL) {
+      recv(sock, buf, nl + 1 - buf, 0);
+      *nl = '\0';
+      snprintf(line, len, "%s", buf + TTYBUS_HELLO_MAGIC_LEN);
+      ret = 1;
+      break;
+    }
+    if (r == sizeof(buf) - 1) {
+      ret = -1;
+      break;
+    }
+    if (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))
+      break;
+    want = r + 1;
+  }
+  want = 1;
+  setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, &want, sizeof(want));
+  return ret;
+}
+
+
+/* The optional handshake of a peer that connected: a hello line, sent before
+ * anything else, naming the bus it wants among the -s ones and/or asking for
+ * compression, which gets an answer. Returns the bus path, or NULL if the peer
+ * asked for a bus that isn't served. */
+static char *plug_handshake(int sock) {
+  char line[TTYBUS_HELLO_MAX], *opt, *save = NULL, *path = tty_bus_path;
+  int i, r, compress = 0;
+
+  r = hello_peek(sock, line, sizeof(line), HANDSHAKE_WAIT);
+  if (r <= 0)
+    return r < 0 ? NULL : tty_bus_path;
+  for (opt = strtok_r(line, " ", &save); opt; opt = strtok_r(NULL, " ", &save)) {
+    if (strncmp(opt, "bus=", 4) == 0) {
+      for (i = 0; i < nbus_paths && strcmp(opt + 4, bus_paths[i]) != 0; i++)
+        ;
+      if (i == nbus_paths) {
+        fprintf(stderr, "Peer asked for bus %s, not served here\n", opt + 4);
+        syslog(LOG_WARNING, "Peer asked for bus %s, not served here\n", opt + 4);
+        return NULL;
+      }
+      path = bus_paths[i];
+    } else if (strcmp(opt, "compress=deflate") == 0) {
+      compress = 1;
+    }
+  }
+  if (compress) {
+    zip_on = zip_level > 0;
+    if (ttybus_hello(sock, zip_on ? "compress=deflate" : "compress=none", -1, NULL, 0, NULL) < 0)
+      return NULL;
+  }
+  return path;
+}
+
+
+/* Deflate len bytes of bus data into the link, or with Z_SYNC_FLUSH only push
+ * out what is pending, so that the peer can inflate all of it right away */
+static int zip_write(int out, char *buf, int len, int flush) {
+  char zbuf[BUFFER_SIZE];
+  uint64_t t;
+  int n;
+
+  zout.next_in = (Bytef *) buf;
+  zout.avail_in = len;
+  do {
+    zout.next_out = (Bytef *) zbuf;
+    zout.avail_out = sizeof(zbuf);
+    t = cpu_ns();
+    deflate(&zout, flush);  // Z_BUF_ERROR only means there was nothing to do
+    stats.zip_ns += cpu_ns() - t;
+    n = sizeof(zbuf) - zout.avail_out;
+    if (n > 0 && ttybus_write_all(out, zbuf, n) < 0)
+      return -1;
+    stats.wire_out += n;
+  } while (zout.avail_out == 0);
+  return 0;
+}
+
+
+static int peer_flush(int out) {
+  uint64_t held;
+
+  if (!hold_since)
+    return 0;
+  held = now_ns() - hold_since;
+  stats.flushes++;
+  stats.hold_ns += held;
+  if (held > stats.hold_max_ns)
+    stats.hold_max_ns = held;
+  hold_since = 0;
+  hold_bytes = 0;
+  return zip_write(out, NULL, 0, Z_SYNC_FLUSH);
+}
+
+
+/* Send bus data to the peer. Compressed, it goes out at the latest flush_delay
+ * after the oldest byte still pending, or as soon as a buffer's worth is. */
+static int peer_write(int out, char *buf, int len) {
+  stats.bus_out += len;
+  if (!zip_on) {
+    stats.wire_out += len;
+    return ttybus_write_all(out, buf, len);
+  }
+  if (!hold_since)
+    hold_since = now_ns();
+  hold_bytes += len;
+  if (zip_write(out, buf, len, Z_NO_FLUSH) < 0)
+    return -1;
+  if (flush_delay == 0 || hold_bytes >= BUFFER_SIZE)
+    return peer_flush(out);
+  return 0;
+}
+
+
+/* Inflate what the peer sent, and pass it on to the bus. Returns like
+ * ttybus_splice(). */
+static ssize_t peer_read(int in, int fd, char *buf, int len) {
+  char zbuf[BUFFER_SIZE];
+  uint64_t t;
+  ssize_t r;
+  int n, ret;
+
+  r = read(in, zbuf, sizeof(zbuf));
+  if (r <= 0)
+    return r;
+  stats.wire_in += r;
+  zin.next_in = (Bytef *) zbuf;
+  zin.avail_in = r;
+  do {
+    zin.next_out = (Bytef *) buf;
+    zin.avail_out = len;
+    t = cpu_ns();
+    ret = inflate(&zin, Z_SYNC_FLUSH);
+    stats.unzip_ns += cpu_ns() - t;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      snprintf(zip_error, sizeof(zip_error), "%s", zin.msg ? zin.msg : "unexpected end of stream");
+      errno = EPROTO;
+      return -1;
+    }
+    n = len - zin.avail_out;
+    if (n > 0 && ttybus_write_all(fd, buf, n) < 0)
+      return -1;
+    stats.bus_in += n;
+  } while (zin.avail_out == 0);
+  return r;
+}
+
+
+/* Forward between the bus and the peer, STDIN/STDOUT or a TCP connection,
+ * until one of them goes away. Returns 0 when the peer did, -1 when the bus
+ * did or on error, -2 when the peer's compressed stream is corrupt. */
+static int plug_loop(int fd, int in, int out) {
+  struct pollfd pfd[3];
   char buffer[BUFFER_SIZE];
+  int pollret, r, timeout;
+  int64_t left;
+
+  if (init_string && (peer_write(out, init_string, strlen(init_string)) < 0 || peer_write(out, "\n", 1) < 0))
+    return 0;
+  // one message per read, and several messages per recvmmsg() the other way
+  down.pkt = bus_pkt;
+  if (bus_pkt)
+    up.fallback = 1;
+  for (;;) {
+    pfd[0].fd = in;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fd;
+    pfd[1].events = POLLIN;
+    if (ring_on) {
+      while ((r = ttybus_ring_read(&ring, buffer, BUFFER_SIZE)) > 0)
+        if (peer_write(out, buffer, r) < 0)
+          return 0;
+      if (ttybus_ring_arm(&ring))
+        continue;
+      pfd[2].fd = ring.efd;
+      pfd[2].events = POLLIN;
+    }
+    timeout = 1000;
+    if (hold_since) {
+      left = (int64_t) (hold_since + flush_delay * 1000000ULL - now_ns());
+      timeout = left > 0 ? (left + 999999) / 1000000 : 0;
+    }
+    pollret = poll(pfd, ring_on ? 3 : 2, timeout);
+    if (pollret < 0 && errno != EINTR) {
+      fprintf(stderr, "Poll error: %s\n", strerror(errno));
+      syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
+      return -1;
+    }
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats();
+    }
+    if (hold_since && now_ns() - hold_since >= flush_delay * 1000000ULL && peer_flush(out) < 0)
+      return 0;
+    if (pollret <= 0)
+      continue;
+
+    if (pfd[0].revents & POLLHUP || pfd[0].revents & POLLERR || pfd[0].revents & POLLNVAL)
+      return 0;
+    if (pfd[1].revents & POLLHUP || pfd[1].revents & POLLERR || pfd[1].revents & POLLNVAL)
+      return -1;
+
+    if (ring_on && (pfd[2].revents & POLLIN))
+      ttybus_ring_ack(&ring);
+    if (pfd[0].revents & POLLIN) {
+      pfd[1].events = POLLOUT;
+      pollret = poll(&pfd[1], 1, 50);
+      if (pollret < 0) {
+        fprintf(stderr, "Poll error: %s\n", strerror(errno));
+        syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
+        return -1;
+      }
+      if (pfd[1].revents & POLLOUT) {
+        if (zip_on) {
+          r = peer_read(in, fd, buffer, BUFFER_SIZE);
+        } else if ((r = ttybus_splice(&up, in, fd, buffer, BUFFER_SIZE)) > 0) {
+          stats.bus_in += r;
+          stats.wire_in += r;
+        }
+        if (r == 0)
+          return 0;
+        if (r < 0 && errno == EPROTO)
+          return -2;
+        if (r < 0 && errno != EAGAIN && errno != EINTR)
+          return -1;
+      }
+    }
+    if (pfd[1].revents & POLLIN) {
+      pfd[0].fd = out;
+      pfd[0].events = POLLOUT;
+      pollret = poll(&pfd[0], 1, 50);
+      if (pollret < 0) {
+        fprintf(stderr, "Poll error: %s\n", strerror(errno));
+        syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
+        return -1;
+      }
+      if (pfd[0].revents & POLLOUT) {
+        if (zip_on) {
+          r = bus_pkt ? ttybus_pkt_recv(fd, pkt_buffer, sizeof(pkt_buffer)) : read(fd, pkt_buffer, sizeof(pkt_buffer));
+          if (r > 0 && peer_write(out, pkt_buffer, r) < 0)
+            return 0;
+        } else if ((r = ttybus_splice(&down, fd, out, pkt_buffer, sizeof(pkt_buffer))) > 0) {
+          stats.bus_out += r;
+          stats.wire_out += r;
+        }
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+          return -1;
+      }
+    }
+  }
+}
+
+
+static int plug_run(int fd, int in, int out) {
+  int r;
+
+  memset(&stats, 0, sizeof(stats));
+  hold_since = 0;
+  hold_bytes = 0;
+  if (zip_on) {
+    memset(&zout, 0, sizeof(zout));
+    memset(&zin, 0, sizeof(zin));
+    if (deflateInit(&zout, zip_level) != Z_OK || inflateInit(&zin) != Z_OK) {
+      fprintf(stderr, "Cannot set up compression\n");
+      syslog(LOG_ERR, "Cannot set up compression\n");
+      return -1;
+    }
+  }
+  r = plug_loop(fd, in, out);
+  if (zip_on) {
+    deflateEnd(&zout);
+    inflateEnd(&zin);
+  }
+  return r;
+}
+
+
+int main(int argc, char *argv[]) {
+  int fd, lfd = -1, sock, r;
+  int delay = RECONNECT_MIN;
+  char *path;
+  char hello[TTYBUS_HELLO_MAX];
+  struct sigaction sa;
   int daemonize = 0;
 
   while (1) {
     int c;
-    c = getopt(argc, argv, "dhs:i:");
+    c = getopt(argc, argv, "c:dhl:mn:r:s:i:z:Z:");
     if (c == -1)
       break;
 
     switch (c) {
+      case 'c':
+        connect_addr = strdup(optarg);
+        break;
       case 'd':
         daemonize = 1;
         break;
       case 'h':
         usage(argv[0]);  // implies exit
         break;
+      case 'l':
+        listen_addr = strdup(optarg);
+        break;
+      case 'm':
+        use_ring = 1;
+        break;
+      case 'n':
+        remote_bus = strdup(optarg);
+        break;
+      case 'r':
+        snprintf(role, sizeof(role), "role=%s", optarg);
+        break;
       case 's':
+        if (nbus_paths == MAX_BUS_PATHS)
+          usage(argv[0]);  // implies exit
         tty_bus_path = strdup(optarg);
+        bus_paths[nbus_paths++] = tty_bus_path;
         break;
       case 'i':
         init_string = strdup(optarg);
         break;
+      case 'z':
+        zip_level = atoi(optarg);
+        if (zip_level < 1 || zip_level > 9)
+          usage(argv[0]);  // implies exit
+        break;
+      case 'Z':
+        flush_delay = atoi(optarg);
+        if (flush_delay < 0)
+          usage(argv[0]);  // implies exit
+        break;
       default:
         usage(argv[0]);  // implies exit
     }
   }
-  if (optind < argc)
+  if (optind < argc || (listen_addr && connect_addr) || (remote_bus && !connect_addr) ||
+      (zip_level && !listen_addr && !connect_addr))
     usage(argv[0]);  // implies exit
 
   if (daemonize)
     daemon(0, 0);
 
-  if (!tty_bus_path)
+  if (!tty_bus_path) {
     tty_bus_path = strdup("/tmp/ttybus");
+    bus_paths[nbus_paths++] = tty_bus_path;
+  }
+  ttybus_splice_init(&up);
+  ttybus_splice_init(&down);
 
-  fprintf(stderr, "Connecting to bus: %s\n", tty_bus_path);
-  syslog(LOG_INFO, "Connecting to bus: %s\n", tty_bus_path);
-  fd = tty_connect(tty_bus_path);
-
-  if (init_string) {
-    write(STDOUT_FILENO, init_string, strlen(init_string));
-    write(STDOUT_FILENO, "\n", 1);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_signaled;
+  sigaction(SIGUSR1, &sa, NULL);
+  if (!listen_addr && !connect_addr) {
+    fd = bus_open(tty_bus_path);
+    if (fd < 0)
+      exit(-1);
+    plug_run(fd, STDIN_FILENO, STDOUT_FILENO);
+    syslog(LOG_INFO, "Terminating: connection closed\n");
+    exit(1);
   }
 
+  // a peer going away is handled where the write fails
+  signal(SIGPIPE, SIG_IGN);
+  if (listen_addr && (lfd = tcp_listen(listen_addr)) < 0)
+    exit(1);
   for (;;) {
-    pfd[0].fd = STDIN_FILENO;
-    pfd[0].events = POLLIN;
-    pfd[1].fd = fd;
-    pfd[1].events = POLLIN;
-    pollret = poll(pfd, 2, 1000);
-    if (pollret < 0) {
-      fprintf(stderr, "Poll error: %s\n", strerror(errno));
-      syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
-      exit(1);
-    }
-    if (pollret == 0)
-      continue;
-
-    if ((pfd[0].revents & POLLHUP || pfd[0].revents & POLLERR || pfd[0].revents & POLLNVAL) ||
-        (pfd[1].revents & POLLHUP || pfd[1].revents & POLLERR || pfd[1].revents & POLLNVAL)) {
-      syslog(LOG_INFO, "Terminating: %d %d\n", pfd[0].revents, pfd[1].revents);
-      exit(1);
-    }
-
-    if (pfd[0].revents & POLLIN) {
-      r = read(STDIN_FILENO, buffer, BUFFER_SIZE);
-      pfd[1].events = POLLOUT;
-      pollret = poll(&pfd[1], 1, 50);
-      if (pollret < 0) {
-        fprintf(stderr, "Poll error: %s\n", strerror(errno));
-        syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
-        exit(1);
+    zip_on = 0;
+    if (listen_addr) {
+      sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      if (sock < 0)
+        continue;
+      path = plug_handshake(sock);
+    } else {
+      sock = tcp_connect(connect_addr);
+      if (sock < 0) {
+        sleep(delay);
+        delay = delay * 2 > RECONNECT_MAX ? RECONNECT_MAX : delay * 2;
+        continue;
+      }
+      delay = RECONNECT_MIN;
+      path = tty_bus_path;
+      snprintf(hello, sizeof(hello), "%s%s%s", remote_bus ? "bus=" : "", remote_bus ? remote_bus : "",
+               zip_level ? (remote_bus ? " compress=deflate" : "compress=deflate") : "");
+      if (hello[0] && ttybus_hello(sock, hello, -1, NULL, 0, NULL) < 0) {
+        close(sock);
+        continue;
+      }
+      /* The listener answers before anything else, however slow the link:
+       * going on without its answer could leave the two ends disagreeing */
+      if (zip_level) {
+        if (hello_peek(sock, hello, sizeof(hello), REPLY_WAIT) != 1) {
+          fprintf(stderr, "No answer to the compression request, connecting again\n");
+          syslog(LOG_WARNING, "No answer to the compression request, connecting again\n");
+          close(sock);
+          sleep(RECONNECT_MIN);
+          continue;
+        }
+        zip_on = strstr(hello, "compress=deflate") != NULL;
+        if (!zip_on) {
+          fprintf(stderr, "The peer doesn't compress, going on uncompressed\n");
+          syslog(LOG_WARNING, "The peer doesn't compress, going on uncompressed\n");
+        }
       }
-      if (pfd[1].revents & POLLOUT)
-        write(fd, buffer, r);
     }
-    if (pfd[1].revents & POLLIN) {
-      r = read(fd, buffer, BUFFER_SIZE);
-      pfd[0].fd = STDOUT_FILENO;
-      pfd[0].events = POLLOUT;
-      pollret = poll(&pfd[0], 1, 50);
-      if (pollret < 0) {
-        fprintf(stderr, "Poll error: %s\n", strerror(errno));
-        syslog(LOG_ERR, "Poll error: %s\n", strerror(errno));
-        exit(1);
+    tcp_tune(sock);
+    if (path && (fd = bus_open(path)) >= 0) {
+      fprintf(stderr, "Peer connected, bridging to bus %s%s\n", path, zip_on ? ", compressed" : "");
+      syslog(LOG_INFO, "Peer connected, bridging to bus %s%s\n", path, zip_on ? ", compressed" : "");
+      r = plug_run(fd, sock, sock);
+      if (r == 0) {
+        fprintf(stderr, "Peer gone\n");
+        syslog(LOG_INFO, "Peer gone\n");
+      } else if (r == -2) {
+        fprintf(stderr, "Corrupt compressed stream from peer: %s\n", zip_error);
+        syslog(LOG_ERR, "Corrupt compressed stream from peer: %s\n", zip_error);
+      } else {
+        fprintf(stderr, "Bus %s gone\n", path);
+        syslog(LOG_WARNING, "Bus %s gone\n", path);
       }
-      if (pfd[0].revents & POLLOUT)
-        write(STDOUT_FILENO, buffer, r);
+      print_stats();
+      bus_close(fd);
     }
+    close(sock);
+    if (connect_addr)
+      sleep(RECONNECT_MIN);
   }
 }
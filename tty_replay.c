@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "configure.h"
+#include "ttybus.h"
+
+#define MAX_FILES 64
+
+struct cap_file {
+  char *name;
+  char *map;
+  size_t len;
+  struct ttybus_cap_hdr *hdr;
+  uint64_t end;  // hdr->end when loaded: a live capture keeps growing
+};
+
+static char *tty_bus_path;
+static struct cap_file files[MAX_FILES];
+static int nfiles = 0;
+
+
+static void usage(char *app) {
+  fprintf(stderr, "%s, Ver %s.%s.%s\n", basename(app), MAJORV, MINORV, SVNVERSION);
+  fprintf(stderr, "Usage: %s [-h] [-s bus_path] [-x speed] [-c client_id] capture_file...\n", app);
+  fprintf(stderr, "-h: shows this help\n");
+  fprintf(stderr, "-s bus_path: uses bus_path as bus path name (default: /tmp/ttybus)\n");
+  fprintf(stderr, "-x speed: replay speed, relative to the recording (default: 1); 0 sends as fast as possible\n");
+  fprintf(stderr, "-c client_id: only replay what this client sent\n\n");
+  fprintf(stderr, "Sends the traffic recorded with tty_bus --capture to the bus again. Capture files are replayed\n");
+  fprintf(stderr, "in the order they were written, whatever the order they are given in.\n");
+  fprintf(stderr, "Please also see: tty_bus, tty_attach, tty_fake, tty_plug, dpipe\n");
+  fprintf(stderr, "Example of usage:\n");
+  fprintf(stderr, "  Replay a GPS session 100 times faster than it was recorded\n");
+  fprintf(stderr, "    tty_replay -s /tmp/gpsmux -x 100 /var/log/gps.cap.2 /var/log/gps.cap.1 /var/log/gps.cap\n");
+  exit(2);
+}
+
+
+int tty_connect(char *path) {
+  int pkt;
+  int connect_fd = ttybus_connect(path, &pkt);
+  if (connect_fd < 0) {
+    perror("Cannot connect to socket");
+    syslog(LOG_ERR, "Cannot connect to socket\n");
+    exit(-1);
+  }
+  return connect_fd;
+}
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int cap_load(struct cap_file *f, char *name) {
+  struct stat st;
+  int fd = open(name, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < TTYBUS_CAP_HDR_SIZE) {
+    fprintf(stderr, "Cannot read capture file %s\n", name);
+    return -1;
+  }
+  f->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (f->map == MAP_FAILED) {
+    fprintf(stderr, "Cannot map capture file %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  f->name = name;
+  f->len = st.st_size;
+  f->hdr = (struct ttybus_cap_hdr *) f->map;
+  f->end = __atomic_load_n(&f->hdr->end, __ATOMIC_ACQUIRE);
+  if (memcmp(f->hdr->magic, TTYBUS_CAP_MAGIC, sizeof(f->hdr->magic)) != 0 || f->end > f->len) {
+    fprintf(stderr, "%s is not a tty_bus capture file\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int cap_cmp(const void *a, const void *b) {
+  const struct cap_file *x = a, *y = b;
+  return (x->hdr->seq > y->hdr->seq) - (x->hdr->seq < y->hdr->seq);
+}
+
+
+static int write_all(int fd, char *buf, int len) {
+  int w;
+  while (len > 0) {
+    w = write(fd, buf, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return -1;
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+  struct ttybus_cap_rec rec;
+  struct timespec when;
+  double speed = 1.0;
+  long src_filter = -1;
+  uint64_t first = 0, start = 0, target, sent, late;
+  uint64_t chunks = 0, bytes = 0, late_sum = 0, late_max = 0;
+  double secs, recorded;
+  uint64_t last = 0;
+  size_t off;
+  int fd, i;
+
+  while (1) {
+    int c;
+    c = getopt(argc, argv, "c:hs:x:");
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'c':
+        src_filter = atol(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);  // implies exit
+        break;
+      case 's':
+        tty_bus_path = strdup(optarg);
+        break;
+      case 'x':
+        speed = atof(optarg);
+        if (speed < 0)
+          usage(argv[0]);  // implies exit
+        break;
+      default:
+        usage(argv[0]);  // implies exit
+    }
+  }
+  if (optind == argc || argc - optind > MAX_FILES)
+    usage(argv[0]);  // implies exit
+
+  for (i = optind; i < argc; i++) {
+    if (cap_load(&files[nfiles++], argv[i]) < 0)
+      exit(1);
+  }
+  qsort(files, nfiles, sizeof(struct cap_file), cap_cmp);
+
+  if (!tty_bus_path)
+    tty_bus_path = strdup("/tmp/ttybus");
+
+  fprintf(stderr, "Connecting to bus: %s\n", tty_bus_path);
+  syslog(LOG_INFO, "Connecting to bus: %s\n", tty_bus_path);
+  fd = tty_connect(tty_bus_path);
+
+  // data from the bus is never read: the bus drops what doesn't fit
+  for (i = 0; i < nfiles; i++) {
+    struct cap_file *f = &files[i];
+    // what is captured meanwhile, possibly this replay itself, is left out
+    for (off = f->hdr->hdr_size; off + sizeof(rec) <= f->end;
+         off += (sizeof(rec) + rec.len + TTYBUS_CAP_ALIGN - 1) & ~(TTYBUS_CAP_ALIGN - 1)) {
+      memcpy(&rec, f->map + off, sizeof(rec));
+      if (off + sizeof(rec) + rec.len > f->end)
+        break;
+      if (src_filter >= 0 && rec.src != (uint32_t) src_filter)
+        continue;
+      if (!start) {
+        first = rec.time;
+        start = now_ns();
+      }
+      target = start;
+      if (speed > 0) {
+        target += (uint64_t) ((rec.time - first) / speed);
+        when.tv_sec = target / 1000000000ULL;
+        when.tv_nsec = target % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR)
+          ;
+      }
+      sent = now_ns();
+      if (write_all(fd, f->map + off + sizeof(rec), rec.len) < 0) {
+        fprintf(stderr, "Bus write error: %s\n", strerror(errno));
+        syslog(LOG_ERR, "Bus write error: %s\n", strerror(errno));
+        exit(1);
+      }
+      if (speed > 0) {
+        late = sent > target ? sent - target : 0;
+        late_sum += late;
+        if (late > late_max)
+          late_max = late;
+      }
+      last = rec.time;
+      chunks++;
+      bytes += rec.len;
+    }
+  }
+
+  secs = start ? (now_ns() - start) / 1e9 : 0;
+  recorded = (last - first) / 1e9;
+  printf("chunks %lu bytes %lu recorded %.3fs replayed %.3fs speed %.2fx throughput %.0f bytes/s %.0f chunks/s",
+         (unsigned long) chunks, (unsigned long) bytes, recorded, secs, secs > 0 ? recorded / secs : 0.0,
+         secs > 0 ? bytes / secs : 0.0, secs > 0 ? chunks / secs : 0.0);
+  if (speed > 0)
+    printf(" late mean %.1fus max %.1fus", chunks ? late_sum / 1e3 / chunks : 0.0, late_max / 1e3);
+  printf("\n");
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include "ttybus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+/* Connect to the bus at path, as a stream or, if the bus is a packet bus, as
+ * SOCK_SEQPACKET, telling which in *pkt. Returns the fd, or -1. */
+int ttybus_connect(const char *path, int *pkt) {
+  struct sockaddr_un sun;
+  int fd;
+
+  memset(&sun, 0, sizeof(struct sockaddr_un));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+  for (*pkt = 0; *pkt < 2; (*pkt)++) {
+    fd = socket(PF_UNIX, *pkt ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0)
+      return fd;
+    close(fd);
+    if (errno != EPROTOTYPE)
+      break;
+  }
+  *pkt = 0;
+  return -1;
+}
+
+
+/* Read the messages waiting on a packet bus, up to TTYBUS_PKT_BATCH of them in
+ * one recvmmsg(), and pack their payloads into buf, without the headers.
+ * Returns the number of bytes, 0 at end of file, or -1 (EAGAIN if there was
+ * nothing to read; fd may be blocking, only the first message is waited for). */
+int ttybus_pkt_recv(int fd, char *buf, int len) {
+  struct ttybus_pkt_hdr hdr[TTYBUS_PKT_BATCH];
+  struct mmsghdr msgs[TTYBUS_PKT_BATCH];
+  struct iovec iov[TTYBUS_PKT_BATCH][2];
+  int i, n, vlen = len / TTYBUS_PKT_MAX, total = 0;
+  unsigned int size;
+
+  if (vlen < 1)
+    vlen = 1;
+  if (vlen > TTYBUS_PKT_BATCH)
+    vlen = TTYBUS_PKT_BATCH;
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < vlen; i++) {
+    iov[i][0].iov_base = &hdr[i];
+    iov[i][0].iov_len = sizeof(hdr[i]);
+    iov[i][1].iov_base = buf + i * TTYBUS_PKT_MAX;
+    iov[i][1].iov_len = len - i * TTYBUS_PKT_MAX < TTYBUS_PKT_MAX ? len - i * TTYBUS_PKT_MAX : TTYBUS_PKT_MAX;
+    msgs[i].msg_hdr.msg_iov = iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 2;
+  }
+  // the first message may block; the rest are only taken if already there
+  n = recvmmsg(fd, msgs, vlen, MSG_WAITFORONE, NULL);
+  if (n <= 0)
+    return n;
+  for (i = 0; i < n; i++) {
+    // an empty message is how recvmmsg() reports the end of the stream
+    if (msgs[i].msg_len < sizeof(struct ttybus_pkt_hdr))
+      break;
+    size = msgs[i].msg_len - sizeof(struct ttybus_pkt_hdr);
+    if (buf + total != iov[i][1].iov_base)
+      memmove(buf + total, iov[i][1].iov_base, size);
+    total += size;
+  }
+  return total;
+}
+
+
+/* Send the hello line, optionally passing 'sendfd' along with it. If 'reply'
+ * is given, wait for the bus answer and store it (without the magic), together
+ * with the fd attached to it, if any. Bus data that arrives before the answer
+ * is discarded: the client is not fully connected yet. */
+int ttybus_hello(int fd, const char *opts, int sendfd, char *reply, int replylen, int *recvfd) {
+  char line[TTYBUS_HELLO_MAX];
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int len;
+  ssize_t r;
+
+  len = snprintf(line, sizeof(line), "%.*s%s\n", TTYBUS_HELLO_MAGIC_LEN - 1, TTYBUS_HELLO_MAGIC + 1, opts);
+  if (len >= (int) sizeof(line) - 1)
+    return -1;
+  // the magic starts with a NUL, which snprintf can't produce
+  memmove(line + 1, line, len);
+  line[0] = '\0';
+  len++;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = line;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (sendfd >= 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sendfd, sizeof(int));
+  }
+  if (sendmsg(fd, &msg, 0) != len)
+    return -1;
+  if (!reply)
+    return 0;
+
+  if (recvfd)
+    *recvfd = -1;
+  for (;;) {
+    char buf[TTYBUS_RING_MAXREC];
+    char *start, *end;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && recvfd)
+        memcpy(recvfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    start = memmem(buf, r, TTYBUS_HELLO_MAGIC, TTYBUS_HELLO_MAGIC_LEN);
+    if (!start)
+      continue;
+    start += TTYBUS_HELLO_MAGIC_LEN;
+    end = memchr(start, '\n', r - (start - buf));
+    if (!end || end - start >= replylen)
+      return -1;
+    memcpy(reply, start, end - start);
+    reply[end - start] = '\0';
+    return 0;
+  }
+}
+
+
+/* Ask the bus for its broadcast ring and map it, sending the other hello
+ * options in opts (may be NULL) along. Returns -1 if the bus has no ring (or
+ * no room for another consumer); the caller then keeps reading its data from
+ * the socket as usual, the other options still apply. */
+int ttybus_ring_attach(int busfd, const char *opts, struct ttybus_ring *r) {
+  char hello[TTYBUS_HELLO_MAX];
+  char reply[TTYBUS_HELLO_MAX];
+  int memfd = -1;
+  unsigned int id;
+  int slot;
+  void *map;
+  struct ttybus_ring_hdr hdr;
+
+  memset(r, 0, sizeof(*r));
+  r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r->efd < 0)
+    return -1;
+  snprintf(hello, sizeof(hello), "%s%sring", opts ? opts : "", opts && opts[0] ? " " : "");
+  if (ttybus_hello(busfd, hello, r->efd, reply, sizeof(reply), &memfd) < 0 ||
+      sscanf(reply, "ring id=%u slot=%d", &id, &slot) != 2 || memfd < 0)
+    goto fail;
+
+  if (pread(memfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != TTYBUS_RING_MAGIC)
+    goto fail;
+  r->maplen = hdr.data_off + hdr.size;
+  map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  close(memfd);
+  r->hdr = map;
+  r->data = (char *) map + hdr.data_off;
+  r->id = id;
+  r->slot = slot;
+  r->cursor = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+  return 0;
+
+fail:
+  if (memfd >= 0)
+    close(memfd);
+  close(r->efd);
+  r->efd = -1;
+  return -1;
+}
+
+
+/* Copy the next record sent by someone else into buf. Returns its length, or
+ * 0 when the consumer has caught up with the producer. */
+int ttybus_ring_read(struct ttybus_ring *r, char *buf, int len) {
+  struct ttybus_ring_rec rec;
+  uint64_t head;
+  uint32_t off, size = r->hdr->size;
+
+  for (;;) {
+    head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    if (r->cursor == head)
+      return 0;
+    if (head - r->cursor > size)
+      goto overrun;
+    off = r->cursor & (size - 1);
+    memcpy(&rec, r->data + off, sizeof(rec));
+    if (rec.pos != r->cursor)
+      goto overrun;
+    if (rec.len == TTYBUS_RING_PAD) {
+      r->cursor += size - off;
+      continue;
+    }
+    if (rec.len > TTYBUS_RING_MAXREC || (int) rec.len > len)
+      goto overrun;
+    memcpy(buf, r->data + off + sizeof(rec), rec.len);
+    // the copy is only valid if the producer didn't reach it meanwhile
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    if (head + sizeof(rec) + TTYBUS_RING_MAXREC - r->cursor > size)
+      goto overrun;
+    r->cursor += (sizeof(rec) + rec.len + TTYBUS_RING_ALIGN - 1) & ~(TTYBUS_RING_ALIGN - 1);
+    if (rec.src == r->id)
+      continue;
+    return rec.len;
+
+  overrun:
+    r->overruns++;
+    r->cursor = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+  }
+}
+
+
+/* Announce that the consumer is about to sleep on its eventfd. Returns 1 if
+ * data was published in the meantime, and the caller must not sleep. */
+int ttybus_ring_arm(struct ttybus_ring *r) {
+  struct ttybus_ring_consumer *c = &r->hdr->consumer[r->slot];
+
+  if (!__atomic_exchange_n(&c->armed, 1, __ATOMIC_SEQ_CST))
+    __atomic_fetch_add(&r->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->hdr->head, __ATOMIC_SEQ_CST) == r->cursor)
+    return 0;
+  if (__atomic_exchange_n(&c->armed, 0, __ATOMIC_SEQ_CST))
+    __atomic_fetch_sub(&r->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+
+void ttybus_ring_ack(struct ttybus_ring *r) {
+  uint64_t v;
+  while (read(r->efd, &v, sizeof(v)) > 0)
+    ;
+}
+
+
+/* Unmap the ring. The bus gives the consumer slot back when the connection it
+ * was asked on closes. */
+void ttybus_ring_detach(struct ttybus_ring *r) {
+  munmap(r->hdr, r->maplen);
+  close(r->efd);
+  r->hdr = NULL;
+  r->efd = -1;
+}
+
+
+void ttybus_splice_init(struct ttybus_splice *s) {
+  s->fallback = pipe2(s->pipefd, O_CLOEXEC) < 0;
+  s->pkt = 0;
+}
+
+
+/* Write all of buf, waiting for out to become writable if it is non-blocking */
+int ttybus_write_all(int out, char *buf, size_t len) {
+  struct pollfd pfd;
+  ssize_t w;
+
+  while (len > 0) {
+    w = write(out, buf, len);
+    if (w < 0 && errno == EAGAIN) {
+      pfd.fd = out;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return -1;
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+
+/* Move what is available on in (at least one byte, in must be readable) to
+ * out. Returns the number of bytes moved, 0 at end of file, -1 on error. */
+ssize_t ttybus_splice(struct ttybus_splice *s, int in, int out, char *buf, size_t len) {
+  struct pollfd pfd;
+  ssize_t r, w, left;
+
+  if (!s->fallback && !s->pkt) {
+    r = splice(in, NULL, s->pipefd[1], NULL, TTYBUS_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (r < 0 && errno == EINVAL) {
+      s->fallback = 1;
+    } else if (r <= 0) {
+      return r;
+    } else {
+      for (left = r; left > 0; left -= w) {
+        w = splice(s->pipefd[0], NULL, out, NULL, left, SPLICE_F_MOVE);
+        if (w < 0 && errno == EAGAIN) {
+          pfd.fd = out;
+          pfd.events = POLLOUT;
+          poll(&pfd, 1, -1);
+          w = 0;
+        } else if (w < 0 && errno == EINVAL) {
+          // out can't splice: empty the pipe the old way
+          s->fallback = 1;
+          while (left > 0 && (w = read(s->pipefd[0], buf, left < (ssize_t) len ? left : (ssize_t) len)) > 0) {
+            if (ttybus_write_all(out, buf, w) < 0)
+              return -1;
+            left -= w;
+          }
+          return r;
+        } else if (w < 0 && errno != EINTR) {
+          return -1;
+        } else if (w < 0) {
+          w = 0;
+        }
+      }
+      return r;
+    }
+  }
+  r = s->pkt ? ttybus_pkt_recv(in, buf, len) : read(in, buf, len);
+  if (r <= 0)
+    return r;
+  return ttybus_write_all(out, buf, r) < 0 ? -1 : r;
+}
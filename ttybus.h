@@ -0,0 +1,152 @@
+#ifndef TTYBUS_H
+#define TTYBUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Connection handshake.
+ * A client may open its stream with a single hello line: TTYBUS_HELLO_MAGIC
+ * followed by space separated options and a newline, sent in one write before
+ * any data. A stream starting with any other byte is plain bus data, so old
+ * clients keep working unchanged. The bus answers with a line in the same
+ * format when an option needs a reply.
+ * "prefix=p1,p2..." and "match=m1,m2..." subscribe the client to the lines
+ * starting with one of the prefixes or containing one of the patterns only;
+ * %XX in a pattern stands for the byte of hex value XX.
+ * "policy=name" picks what the bus does when the client can't keep up:
+ * drop-newest, drop-oldest, block or disconnect (see tty_bus --policy).
+ * "role=name" narrows the traffic of the client: listen (what it sends is
+ * dropped), talk (it gets nothing), star (what it sends goes to the device
+ * endpoints only) or device (tty_attach, tty_bus --attach); both is the
+ * default. The shared ring still carries everything to its readers.
+ * "ctl" puts the connection on the control channel of the bus: it only talks
+ * to the other control connections, out of band of the bus data. */
+#define TTYBUS_HELLO_MAGIC     "\0ttybus:"
+#define TTYBUS_HELLO_MAGIC_LEN 8
+#define TTYBUS_HELLO_MAX       256
+
+/* Control channel line sent by tty_fake when the application on the fake tty
+ * changes the line settings, and applied by tty_attach to the real device:
+ * "termios speed=<baud> stop=<1|2> flow=<none|rtscts>\n". Linux ptys force
+ * 8 bits and no parity, so those are never heard of. */
+#define TTYBUS_CTL_TERMIOS     "termios"
+#define TTYBUS_CTL_MAX         128
+
+
+/* Shared-memory broadcast ring.
+ * tty_bus writes every chunk once into a memfd-backed ring, and local clients
+ * that asked for it with the "ring" hello option map the ring and read it at
+ * their own cursor. Records never wrap: a record that doesn't fit before the
+ * end of the data area is preceded by a TTYBUS_RING_PAD record. The producer
+ * never waits for consumers; a consumer that falls more than the ring size
+ * behind skips ahead to the current head. */
+#define TTYBUS_RING_MAGIC     0x54425247
+#define TTYBUS_RING_CONSUMERS 256
+#define TTYBUS_RING_MAXREC    4096
+#define TTYBUS_RING_PAD       0xffffffffU
+#define TTYBUS_RING_ALIGN     16
+
+struct ttybus_ring_consumer {
+  uint32_t armed;  // set by a consumer about to sleep on its eventfd
+  uint32_t id;
+};
+
+struct ttybus_ring_hdr {
+  uint32_t magic;
+  uint32_t size;      // data area size, power of two
+  uint32_t data_off;  // offset of the data area in the mapping
+  uint32_t waiters;   // consumers currently armed
+  uint64_t head;      // bytes published so far
+  struct ttybus_ring_consumer consumer[TTYBUS_RING_CONSUMERS];
+};
+
+struct ttybus_ring_rec {
+  uint64_t pos;  // ring position the record was written at, to detect overruns
+  uint32_t len;
+  uint32_t src;  // id of the client that sent it
+};
+
+
+/* Capture files (tty_bus --capture).
+ * A TTYBUS_CAP_HDR_SIZE header followed by records, each one a struct
+ * ttybus_cap_rec and its payload, padded to TTYBUS_CAP_ALIGN. 'end' is only
+ * advanced once a record is complete, so a file can be read while it is being
+ * written. Files rotate when full: the current one keeps the capture path,
+ * older ones get .1, .2... appended, and 'seq' tells them apart. */
+#define TTYBUS_CAP_MAGIC    "TTYBCAP1"
+#define TTYBUS_CAP_HDR_SIZE 4096
+#define TTYBUS_CAP_ALIGN    8
+
+struct ttybus_cap_hdr {
+  char magic[8];
+  uint32_t hdr_size;    // offset of the first record
+  uint32_t seq;         // number of the file in the capture, from 0
+  uint64_t size;        // size the file was created with
+  uint64_t end;         // offset past the last complete record
+  uint64_t records;
+  uint64_t start_mono;  // CLOCK_MONOTONIC and CLOCK_REALTIME when the file
+  uint64_t start_real;  // was started, in ns, to put record times on a clock
+  char bus[108];
+};
+
+struct ttybus_cap_rec {
+  uint64_t time;  // CLOCK_MONOTONIC, ns
+  uint32_t src;   // id of the client that sent it
+  uint32_t len;
+};
+
+
+/* Packet buses (tty_bus -P).
+ * The bus sockets are SOCK_SEQPACKET: each write to the bus, of at most
+ * TTYBUS_PKT_MAX bytes, stays one message, and each message from the bus
+ * starts with a struct ttybus_pkt_hdr. 'seq' counts the messages of the bus,
+ * so a gap tells a client that the bus dropped something on its way to it;
+ * the messages a filter, role or transaction keeps from it leave gaps too.
+ * Clients find out by getting EPROTOTYPE from a SOCK_STREAM connect(). */
+#define TTYBUS_PKT_MAX   4096
+#define TTYBUS_PKT_BATCH 16  // messages moved per recvmmsg()/sendmmsg()
+
+struct ttybus_pkt_hdr {
+  uint32_t src;  // id of the client that sent it
+  uint32_t seq;
+};
+
+
+/* Client side helpers, in ttybus.c */
+struct ttybus_ring {
+  struct ttybus_ring_hdr *hdr;
+  char *data;
+  size_t maplen;
+  uint64_t cursor;
+  uint32_t id;
+  int slot;
+  int efd;
+  unsigned long overruns;
+};
+
+/* Forwarding between two fds with splice() through a pipe, so the data never
+ * goes through user space. Falls back to read()/write() through the caller's
+ * buffer for good as soon as one of the fds turns out not to support it. */
+#define TTYBUS_SPLICE_MAX 65536
+
+struct ttybus_splice {
+  int pipefd[2];
+  int fallback;
+  int pkt;  // in is a packet bus: read with ttybus_pkt_recv()
+};
+
+void ttybus_splice_init(struct ttybus_splice *s);
+ssize_t ttybus_splice(struct ttybus_splice *s, int in, int out, char *buf, size_t len);
+int ttybus_write_all(int out, char *buf, size_t len);
+
+int ttybus_connect(const char *path, int *pkt);
+int ttybus_pkt_recv(int fd, char *buf, int len);
+int ttybus_hello(int fd, const char *opts, int sendfd, char *reply, int replylen, int *recvfd);
+int ttybus_ring_attach(int busfd, const char *opts, struct ttybus_ring *r);
+int ttybus_ring_read(struct ttybus_ring *r, char *buf, int len);
+int ttybus_ring_arm(struct ttybus_ring *r);
+void ttybus_ring_ack(struct ttybus_ring *r);
+void ttybus_ring_detach(struct ttybus_ring *r);
+
+#endif